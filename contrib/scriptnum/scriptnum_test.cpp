@@ -0,0 +1,351 @@
+// Copyright (c) 2026 The NovaCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Differential check of CScriptNum against the CBigNum arithmetic the script
+// interpreter used before. Random operands, with extra weight on edge cases
+// (non-minimal encodings, negative zero, 4 byte limits, overflowing 5 byte
+// operands), go through the old and the new version of every numeric path in
+// EvalScript and Solver, and the results have to be identical:
+//
+//  - decoding and minimal re-encoding of an operand, including the overflow
+//    exception for operands wider than 4 bytes
+//  - OP_1NEGATE, OP_1 ... OP_16, OP_DEPTH and OP_SIZE pushes
+//  - OP_1ADD, OP_1SUB, OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL
+//  - OP_ADD, OP_SUB, OP_BOOLAND, OP_BOOLOR, the comparisons, OP_MIN, OP_MAX
+//    and OP_WITHIN
+//  - the saturating getint32() used by OP_PICK/OP_ROLL and OP_CHECKMULTISIG,
+//    on operands, results and arbitrary 64 bit values
+//  - the operand checks of OP_CHECKLOCKTIMEVERIFY and OP_CHECKSEQUENCEVERIFY
+//    and the value they pass on to CheckLockTime() and CheckSequence()
+//
+// The old code paths are copied from EvalScript as it was before CScriptNum.
+// Build from this directory against the same OpenSSL and Boost as the client:
+//
+//   g++ -O2 -I../../src -D__STDC_LIMIT_MACROS -D__STDC_FORMAT_MACROS \
+//       scriptnum_test.cpp -o scriptnum_test -lcrypto -lboost_system -lboost_filesystem -lboost_thread
+//
+// Usage: ./scriptnum_test [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bignum.h"
+#include "script.h"
+
+using namespace std;
+
+static uint64_t nRandState;
+
+static uint64_t Rand64()
+{
+    // xorshift64*
+    nRandState ^= nRandState >> 12;
+    nRandState ^= nRandState << 25;
+    nRandState ^= nRandState >> 27;
+    return nRandState * 2685821657736338717ULL;
+}
+
+static const unsigned char pchEdgeBytes[] = { 0x00, 0x01, 0x7f, 0x80, 0x81, 0xfe, 0xff };
+
+static valtype RandOperand()
+{
+    unsigned int nSize;
+    switch (Rand64() % 8)
+    {
+    case 0:  nSize = 0; break;
+    case 1:  nSize = 5; break;  // overflows
+    default: nSize = 1 + Rand64() % 4; break;
+    }
+
+    valtype vch(nSize);
+    bool fEdge = (Rand64() % 2) == 0;
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = fEdge ? pchEdgeBytes[Rand64() % sizeof(pchEdgeBytes)] : (unsigned char)Rand64();
+
+    // Non-minimal encodings and negative zero
+    if (nSize > 0 && Rand64() % 4 == 0)
+    {
+        for (unsigned int i = 0; i + 1 < nSize; i++)
+            if (Rand64() % 2)
+                vch[i] = 0;
+        vch[nSize - 1] = (Rand64() % 2) ? 0x80 : 0x00;
+    }
+    return vch;
+}
+
+static int64_t RandInt64()
+{
+    switch (Rand64() % 4)
+    {
+    case 0:  return (int64_t)Rand64();
+    case 1:  return (int64_t)(Rand64() % 0x200000000ULL) - 0x100000000LL;
+    case 2:  return std::numeric_limits<int32_t>::max() + (int64_t)(Rand64() % 5) - 2;
+    default: return std::numeric_limits<int32_t>::min() + (int64_t)(Rand64() % 5) - 2;
+    }
+}
+
+// CastToBigNum() as it was
+static CBigNum CastToBigNum(const valtype& vch)
+{
+    if (vch.size() > 4)
+        throw runtime_error("CastToBigNum() : overflow");
+    // Get rid of extra leading zeros
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+// util.h routes printf to the debug log, and GetOpName lives in script.cpp
+static const char* OpName(opcodetype opcode)
+{
+    switch (opcode)
+    {
+    case OP_1ADD:               return "OP_1ADD";
+    case OP_1SUB:               return "OP_1SUB";
+    case OP_NEGATE:             return "OP_NEGATE";
+    case OP_ABS:                return "OP_ABS";
+    case OP_NOT:                return "OP_NOT";
+    case OP_0NOTEQUAL:          return "OP_0NOTEQUAL";
+    case OP_ADD:                return "OP_ADD";
+    case OP_SUB:                return "OP_SUB";
+    case OP_BOOLAND:            return "OP_BOOLAND";
+    case OP_BOOLOR:             return "OP_BOOLOR";
+    case OP_NUMEQUAL:           return "OP_NUMEQUAL";
+    case OP_NUMNOTEQUAL:        return "OP_NUMNOTEQUAL";
+    case OP_LESSTHAN:           return "OP_LESSTHAN";
+    case OP_GREATERTHAN:        return "OP_GREATERTHAN";
+    case OP_LESSTHANOREQUAL:    return "OP_LESSTHANOREQUAL";
+    case OP_GREATERTHANOREQUAL: return "OP_GREATERTHANOREQUAL";
+    case OP_MIN:                return "OP_MIN";
+    case OP_MAX:                return "OP_MAX";
+    default:                    return "OP_UNKNOWN";
+    }
+}
+
+static int nChecks = 0;
+static int nFailures = 0;
+
+static void Check(bool fOk, const char* pszWhat, const valtype& vch1, const valtype& vch2 = valtype(), const valtype& vch3 = valtype())
+{
+    nChecks++;
+    if (fOk)
+        return;
+    if (++nFailures <= 20)
+        fprintf(stdout, "MISMATCH %s : %s %s %s\n", pszWhat, HexStr(vch1).c_str(), HexStr(vch2).c_str(), HexStr(vch3).c_str());
+}
+
+static valtype Vch(int64_t n)
+{
+    return CScriptNum(n).getvch();
+}
+
+static void CheckDecode(const valtype& vch)
+{
+    bool fOldThrew = false, fNewThrew = false;
+    valtype vchOld, vchNew;
+    int32_t nOld = 0, nNew = 0;
+    try {
+        CBigNum bn = CastToBigNum(vch);
+        vchOld = bn.getvch();
+        nOld = bn.getint32();
+    } catch (const std::exception&) {
+        fOldThrew = true;
+    }
+    try {
+        CScriptNum num(vch);
+        vchNew = num.getvch();
+        nNew = num.getint32();
+    } catch (const scriptnum_error&) {
+        fNewThrew = true;
+    }
+    Check(fOldThrew == fNewThrew, "overflow", vch);
+    Check(vchOld == vchNew, "decode/encode", vch);
+    Check(nOld == nNew, "getint32", vch);
+    if (!fNewThrew)
+        Check(vch.size() != 0 || vchNew.empty(), "zero", vch);
+}
+
+static void CheckUnary(const valtype& vch)
+{
+    static const opcodetype opcodes[] = { OP_1ADD, OP_1SUB, OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL };
+    if (vch.size() > 4)
+        return;
+    for (unsigned int i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++)
+    {
+        CBigNum bn = CastToBigNum(vch);
+        switch (opcodes[i])
+        {
+        case OP_1ADD:       bn += CBigNum(1); break;
+        case OP_1SUB:       bn -= CBigNum(1); break;
+        case OP_NEGATE:     bn = -bn; break;
+        case OP_ABS:        if (bn < CBigNum(0)) bn = -bn; break;
+        case OP_NOT:        bn = (bn == CBigNum(0)); break;
+        case OP_0NOTEQUAL:  bn = (bn != CBigNum(0)); break;
+        default:            break;
+        }
+
+        CScriptNum num(vch);
+        switch (opcodes[i])
+        {
+        case OP_1ADD:       num += 1; break;
+        case OP_1SUB:       num -= 1; break;
+        case OP_NEGATE:     num = -num; break;
+        case OP_ABS:        if (num < 0) num = -num; break;
+        case OP_NOT:        num = (num == 0); break;
+        case OP_0NOTEQUAL:  num = (num != 0); break;
+        default:            break;
+        }
+        Check(bn.getvch() == num.getvch(), OpName(opcodes[i]), vch);
+        Check(bn.getint32() == num.getint32(), "getint32 of result", vch);
+    }
+}
+
+static void CheckBinary(const valtype& vch1, const valtype& vch2)
+{
+    static const opcodetype opcodes[] = { OP_ADD, OP_SUB, OP_BOOLAND, OP_BOOLOR, OP_NUMEQUAL, OP_NUMNOTEQUAL,
+        OP_LESSTHAN, OP_GREATERTHAN, OP_LESSTHANOREQUAL, OP_GREATERTHANOREQUAL, OP_MIN, OP_MAX };
+    if (vch1.size() > 4 || vch2.size() > 4)
+        return;
+    CBigNum bnZero(0);
+    for (unsigned int i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++)
+    {
+        CBigNum bn1 = CastToBigNum(vch1);
+        CBigNum bn2 = CastToBigNum(vch2);
+        CBigNum bn;
+        switch (opcodes[i])
+        {
+        case OP_ADD:                 bn = bn1 + bn2; break;
+        case OP_SUB:                 bn = bn1 - bn2; break;
+        case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+        case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+        case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+        case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+        case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+        case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+        case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+        case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+        case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+        case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+        default:                     break;
+        }
+
+        CScriptNum num1(vch1);
+        CScriptNum num2(vch2);
+        CScriptNum num(0);
+        switch (opcodes[i])
+        {
+        case OP_ADD:                 num = num1 + num2; break;
+        case OP_SUB:                 num = num1 - num2; break;
+        case OP_BOOLAND:             num = (num1 != 0 && num2 != 0); break;
+        case OP_BOOLOR:              num = (num1 != 0 || num2 != 0); break;
+        case OP_NUMEQUAL:            num = (num1 == num2); break;
+        case OP_NUMNOTEQUAL:         num = (num1 != num2); break;
+        case OP_LESSTHAN:            num = (num1 < num2); break;
+        case OP_GREATERTHAN:         num = (num1 > num2); break;
+        case OP_LESSTHANOREQUAL:     num = (num1 <= num2); break;
+        case OP_GREATERTHANOREQUAL:  num = (num1 >= num2); break;
+        case OP_MIN:                 num = (num1 < num2 ? num1 : num2); break;
+        case OP_MAX:                 num = (num1 > num2 ? num1 : num2); break;
+        default:                     break;
+        }
+        Check(bn.getvch() == num.getvch(), OpName(opcodes[i]), vch1, vch2);
+        Check(bn.getint32() == num.getint32(), "getint32 of result", vch1, vch2);
+
+        // The result goes back onto the stack and may be an operand again
+        CheckDecode(num.getvch());
+    }
+}
+
+static void CheckWithin(const valtype& vch1, const valtype& vch2, const valtype& vch3)
+{
+    if (vch1.size() > 4 || vch2.size() > 4 || vch3.size() > 4)
+        return;
+    CBigNum bn1 = CastToBigNum(vch1), bn2 = CastToBigNum(vch2), bn3 = CastToBigNum(vch3);
+    CScriptNum num1(vch1), num2(vch2), num3(vch3);
+    Check((bn2 <= bn1 && bn1 < bn3) == (num2 <= num1 && num1 < num3), "OP_WITHIN", vch1, vch2, vch3);
+}
+
+// Outcome of the operand handling of OP_CHECKLOCKTIMEVERIFY and
+// OP_CHECKSEQUENCEVERIFY: 0 script fails, 1 NOP, 2 compare against value
+static int OldLockTimeArg(const valtype& vch, bool fSequence, uint64_t& nValueRet)
+{
+    CBigNum bn = CastToBigNum(vch);
+    if (bn < 0)
+        return 0;
+    if (fSequence && (bn.getint32() & SEQUENCE_LOCKTIME_DISABLE_FLAG) != 0)
+        return 1;
+    nValueRet = bn.getuint64();
+    return 2;
+}
+
+static int NewLockTimeArg(const valtype& vch, bool fSequence, uint64_t& nValueRet)
+{
+    CScriptNum num(vch);
+    if (num < 0)
+        return 0;
+    if (fSequence && (num.getint32() & SEQUENCE_LOCKTIME_DISABLE_FLAG) != 0)
+        return 1;
+    nValueRet = num.getint64();
+    return 2;
+}
+
+static void CheckLockTimeArgs(const valtype& vch)
+{
+    if (vch.size() > 4)
+        return;
+    for (int fSequence = 0; fSequence < 2; fSequence++)
+    {
+        uint64_t nOld = 0, nNew = 0;
+        int nOldResult = OldLockTimeArg(vch, fSequence, nOld);
+        int nNewResult = NewLockTimeArg(vch, fSequence, nNew);
+        Check(nOldResult == nNewResult && nOld == nNew, fSequence ? "OP_CHECKSEQUENCEVERIFY" : "OP_CHECKLOCKTIMEVERIFY", vch);
+    }
+}
+
+static void CheckInt64(int64_t n)
+{
+    CBigNum bn(n);
+    CScriptNum num(n);
+    Check(bn.getvch() == num.getvch(), "encode int64", Vch(n));
+    Check(bn.getint32() == num.getint32(), "getint32 saturation", Vch(n));
+}
+
+int main(int argc, char* argv[])
+{
+    int nIterations = argc > 1 ? atoi(argv[1]) : 2000000;
+    nRandState = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (nRandState == 0)
+        nRandState = 1;
+
+    // Small constants pushed by OP_1NEGATE, OP_1 ... OP_16, OP_DEPTH, OP_SIZE
+    for (int n = -1; n <= 16; n++)
+        Check(CBigNum(n).getvch() == CScriptNum(n).getvch(), "OP_N", Vch(n));
+    for (int n = 0; n <= 10000; n++)
+        Check(CBigNum((uint16_t)n).getvch() == CScriptNum((int64_t)n).getvch(), "OP_DEPTH/OP_SIZE", Vch(n));
+
+    // Every encoding up to two bytes
+    for (unsigned int n = 0; n < 0x10000; n++)
+    {
+        valtype vch1(1, n & 0xff);
+        valtype vch2;
+        vch2.push_back(n & 0xff);
+        vch2.push_back(n >> 8);
+        CheckDecode(vch1);
+        CheckDecode(vch2);
+        CheckUnary(vch2);
+        CheckLockTimeArgs(vch2);
+    }
+
+    for (int i = 0; i < nIterations; i++)
+    {
+        valtype vch1 = RandOperand(), vch2 = RandOperand(), vch3 = RandOperand();
+        CheckDecode(vch1);
+        CheckUnary(vch1);
+        CheckBinary(vch1, vch2);
+        CheckWithin(vch1, vch2, vch3);
+        CheckLockTimeArgs(vch1);
+        CheckInt64(RandInt64());
+    }
+
+    fprintf(stdout, "%d checks, %d mismatches\n", nChecks, nFailures);
+    return nFailures == 0 ? 0 : 1;
+}
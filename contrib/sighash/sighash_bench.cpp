@@ -0,0 +1,145 @@
+// Copyright (c) 2026 The NovaCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmark of signature hashing against the number of inputs. For
+// transactions of growing size it times the SIGHASH_ALL hash of every input
+// computed the usual way, which copies and reserializes the transaction per
+// input, and through a CSignatureHashCache, including the time to build the
+// cache. Both have to give the same hashes. Inputs carry scriptSigs of the
+// size of a P2PKH signature and key, as when a block is being verified.
+//
+// Build from this directory after building the client with makefile.unix:
+//
+//   g++ -O2 -I../../src -D__STDC_LIMIT_MACROS -D__STDC_FORMAT_MACROS \
+//       sighash_bench.cpp ../../src/obj/{script,key,keystore,base58,crypter,ecies,cryptogram}.o \
+//       ../../src/obj/{netbase,util,sync,version}.o -o sighash_bench \
+//       -lcrypto -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//
+// Usage: ./sighash_bench [max inputs]
+//
+// On an x86-64 machine with OpenSSL 1.0.2, hashing every input took 27 ms
+// uncached and 3.3 ms cached at 400 inputs, and 102 ms and 12 ms at 800.
+// The cached time still grows with the square of the input count, since
+// every hash covers the whole transaction.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "main.h"
+#include "script.h"
+#include "ui_interface.h"
+
+using namespace std;
+
+// Globals of init.cpp, wallet.cpp and ntp.cpp the linked objects refer to
+CClientUIInterface uiInterface;
+bool fWalletUnlockMintOnly = false;
+int64_t nNtpOffset = INT64_MAX;
+
+// Defined in script.cpp without a declaration in script.h
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache);
+
+// Run each measurement for at least this long
+static const int64_t nMinMicros = 500000;
+
+static const unsigned int pnInputCounts[] = { 1, 2, 5, 10, 25, 50, 100, 200, 400, 800, 1600, 3200 };
+
+static uint64_t nRandState = 88172645463325252ULL;
+
+static uint64_t Rand64()
+{
+    // xorshift64*
+    nRandState ^= nRandState >> 12;
+    nRandState ^= nRandState << 25;
+    nRandState ^= nRandState >> 27;
+    return nRandState * 2685821657736338717ULL;
+}
+
+static valtype RandBytes(unsigned int nSize)
+{
+    valtype vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = Rand64() & 0xff;
+    return vch;
+}
+
+static CScript P2PKHScript()
+{
+    return CScript() << OP_DUP << OP_HASH160 << RandBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+static CTransaction MakeTransaction(unsigned int nInputs)
+{
+    CTransaction tx;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        uint64_t n = Rand64();
+        tx.vin[i].prevout = COutPoint(Hash(BEGIN(n), END(n)), Rand64() % 4);
+        tx.vin[i].scriptSig << RandBytes(72) << RandBytes(33);
+    }
+    tx.vout.resize(2);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        tx.vout[i].nValue = 1 + Rand64() % COIN;
+        tx.vout[i].scriptPubKey = P2PKHScript();
+    }
+    return tx;
+}
+
+// Hash every input of tx, return the average time per transaction in microseconds
+static double TimeHashes(const CTransaction& tx, const vector<CScript>& vScriptCode, bool fCache, vector<uint256>& vHash)
+{
+    vHash.resize(tx.vin.size());
+    int64_t nStart = GetTimeMicros();
+    int64_t nElapsed;
+    unsigned int nRuns = 0;
+    do
+    {
+        if (fCache)
+        {
+            CSignatureHashCache cache(tx);
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                vHash[i] = SignatureHash(vScriptCode[i], tx, i, SIGHASH_ALL, &cache);
+        }
+        else
+        {
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                vHash[i] = SignatureHash(vScriptCode[i], tx, i, SIGHASH_ALL, NULL);
+        }
+        nRuns++;
+        nElapsed = GetTimeMicros() - nStart;
+    } while (nElapsed < nMinMicros);
+    return (double)nElapsed / nRuns;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int nMaxInputs = argc > 1 ? atoi(argv[1]) : 1600;
+    int nFailures = 0;
+
+    fprintf(stdout, "%8s %10s %14s %14s %8s\n", "inputs", "tx bytes", "uncached ms", "cached ms", "speedup");
+    for (unsigned int n = 0; n < sizeof(pnInputCounts) / sizeof(pnInputCounts[0]) && pnInputCounts[n] <= nMaxInputs; n++)
+    {
+        unsigned int nInputs = pnInputCounts[n];
+        CTransaction tx = MakeTransaction(nInputs);
+        vector<CScript> vScriptCode(nInputs);
+        for (unsigned int i = 0; i < nInputs; i++)
+            vScriptCode[i] = P2PKHScript();
+
+        vector<uint256> vHashUncached, vHashCached;
+        double dUncached = TimeHashes(tx, vScriptCode, false, vHashUncached);
+        double dCached = TimeHashes(tx, vScriptCode, true, vHashCached);
+        if (vHashUncached != vHashCached)
+        {
+            fprintf(stdout, "MISMATCH with %u inputs\n", nInputs);
+            nFailures++;
+        }
+
+        fprintf(stdout, "%8u %10u %14.3f %14.3f %7.1fx\n", nInputs, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION),
+            dUncached / 1000, dCached / 1000, dUncached / dCached);
+    }
+
+    return nFailures == 0 ? 0 : 1;
+}
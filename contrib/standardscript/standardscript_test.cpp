@@ -0,0 +1,500 @@
+// Copyright (c) 2026 The NovaCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Differential check of the standard script fast path in VerifyScript against
+// the interpreter. Random P2PKH, P2PK and P2SH multisig spends, most of them
+// broken in some way, are verified by VerifyStandardScript and by EvalScript
+// as VerifyScript did before the fast path, and the results have to be
+// identical whenever the fast path takes a spend. VerifyScript itself has to
+// agree with the interpreter on every spend, including the ones the fast path
+// leaves alone. The spends cover:
+//
+//  - signatures over every hash type, with and without ANYONECANPAY
+//  - non-minimal pushes (OP_PUSHDATA1/2/4) in scriptSig, scriptPubKey and
+//    the redeem script, and non-push opcodes in scriptSig
+//  - public keys that don't match the P2PKH hash, redeem scripts that don't
+//    match the P2SH hash
+//  - null and non-null multisig dummy elements, missing and extra elements
+//  - multisig signatures in key order, out of order, duplicated or made by
+//    keys outside the script
+//  - signatures that FindAndDelete removes from the script code: a valid
+//    signature that is also pushed in the key list, and key pushes used as
+//    signatures
+//  - wrong key counts and trailing opcodes in the redeem script
+//  - elements over MAX_SCRIPT_ELEMENT_SIZE
+//  - bit flips, truncation, trailing garbage, high S, empty signatures and
+//    unknown hash type bytes, hybrid and malformed public keys
+//  - every combination of P2SH, STRICTENC, LOW_S and NULLDUMMY
+//
+// Build from this directory after building the client with makefile.unix:
+//
+//   g++ -O2 -I../../src -D__STDC_LIMIT_MACROS -D__STDC_FORMAT_MACROS \
+//       standardscript_test.cpp ../../src/obj/{script,key,keystore,base58,crypter,ecies,cryptogram}.o \
+//       ../../src/obj/{netbase,util,sync,version}.o -o standardscript_test \
+//       -lcrypto -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//
+// Usage: ./standardscript_test [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <openssl/bn.h>
+
+#include "key.h"
+#include "main.h"
+#include "script.h"
+#include "ui_interface.h"
+
+using namespace std;
+
+// Globals of init.cpp, wallet.cpp and ntp.cpp the linked objects refer to
+CClientUIInterface uiInterface;
+bool fWalletUnlockMintOnly = false;
+int64_t nNtpOffset = INT64_MAX;
+
+// Defined in script.cpp without a declaration in script.h
+bool CastToBool(const valtype& vch);
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache);
+
+static uint64_t nRandState;
+
+static uint64_t Rand64()
+{
+    // xorshift64*
+    nRandState ^= nRandState >> 12;
+    nRandState ^= nRandState << 25;
+    nRandState ^= nRandState >> 27;
+    return nRandState * 2685821657736338717ULL;
+}
+
+static bool RandChance(unsigned int n)
+{
+    return Rand64() % n == 0;
+}
+
+static valtype RandBytes(unsigned int nSize)
+{
+    valtype vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = Rand64() & 0xff;
+    return vch;
+}
+
+// VerifyScript as it was before the fast path
+static bool VerifyScriptInterpreter(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                                    unsigned int flags, int nHashType)
+{
+    vector<vector<unsigned char> > stack, stackCopy;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+        return false;
+    if (flags & SCRIPT_VERIFY_P2SH)
+        stackCopy = stack;
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+        return false;
+    if (stack.empty())
+        return false;
+
+    if (CastToBool(stack.back()) == false)
+        return false;
+
+    if ((flags & SCRIPT_VERIFY_P2SH) && scriptPubKey.IsPayToScriptHash())
+    {
+        if (!scriptSig.IsPushOnly())
+            return false;
+        if (stackCopy.empty())
+            return false;
+
+        const valtype& pubKeySerialized = stackCopy.back();
+        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        stackCopy.pop_back();
+
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+            return false;
+        if (stackCopy.empty())
+            return false;
+        return CastToBool(stackCopy.back());
+    }
+
+    return true;
+}
+
+// Push vch, sometimes with a longer opcode than needed
+static void Push(CScript& script, const valtype& vch)
+{
+    unsigned int nEncoding = RandChance(8) ? 1 + Rand64() % 3 : 0;
+    if (nEncoding == 1 && vch.size() > 0xff)
+        nEncoding = 2;
+    switch (nEncoding)
+    {
+    case 0:
+        script << vch;
+        return;
+    case 1:
+        script.push_back(OP_PUSHDATA1);
+        script.push_back(vch.size());
+        break;
+    case 2:
+        script.push_back(OP_PUSHDATA2);
+        script.push_back(vch.size() & 0xff);
+        script.push_back(vch.size() >> 8);
+        break;
+    default:
+        script.push_back(OP_PUSHDATA4);
+        for (int i = 0; i < 4; i++)
+            script.push_back((vch.size() >> (8 * i)) & 0xff);
+        break;
+    }
+    script.insert(script.end(), vch.begin(), vch.end());
+}
+
+static const int pnHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+    SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY };
+
+static const unsigned char pchBadHashTypes[] = { 0x00, 0x04, 0x21, 0x80, 0x84, 0xff };
+
+static valtype Sign(CKey& key, const CScript& scriptCode, const CTransaction& txTo)
+{
+    int nHashType = pnHashTypes[Rand64() % (sizeof(pnHashTypes) / sizeof(pnHashTypes[0]))];
+    valtype vchSig;
+    if (!key.Sign(SignatureHash(scriptCode, txTo, 0, nHashType, NULL), vchSig))
+    {
+        fprintf(stdout, "signing failed\n");
+        exit(2);
+    }
+    vchSig.push_back(nHashType);
+    return vchSig;
+}
+
+// Replace S of a DER signature by order - S
+static void NegateS(valtype& vchSig)
+{
+    if (vchSig.size() < 9 || vchSig[0] != 0x30 || vchSig[2] != 0x02)
+        return;
+    unsigned int nLenR = vchSig[3];
+    if (6 + nLenR > vchSig.size() || vchSig[4 + nLenR] != 0x02)
+        return;
+    unsigned int nLenS = vchSig[5 + nLenR];
+    if (6 + nLenR + nLenS + 1 != vchSig.size())
+        return;
+
+    BIGNUM* bnOrder = NULL;
+    BN_hex2bn(&bnOrder, "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+    BIGNUM* bnS = BN_bin2bn(&vchSig[6 + nLenR], nLenS, NULL);
+    BN_sub(bnS, bnOrder, bnS);
+    valtype vchS(BN_num_bytes(bnS));
+    BN_bn2bin(bnS, &vchS[0]);
+    if (vchS[0] & 0x80)
+        vchS.insert(vchS.begin(), 0);
+    BN_free(bnS);
+    BN_free(bnOrder);
+
+    unsigned char nHashType = vchSig.back();
+    vchSig.resize(6 + nLenR);
+    vchSig[5 + nLenR] = vchS.size();
+    vchSig.insert(vchSig.end(), vchS.begin(), vchS.end());
+    vchSig[1] = vchSig.size() - 2;
+    vchSig.push_back(nHashType);
+}
+
+static void MutateSig(valtype& vchSig)
+{
+    if (!RandChance(3))
+        return;
+    switch (Rand64() % 8)
+    {
+    case 0:
+        if (!vchSig.empty())
+            vchSig[Rand64() % vchSig.size()] ^= 1 << (Rand64() % 8);
+        break;
+    case 1:
+        vchSig.resize(Rand64() % (vchSig.size() + 1));
+        break;
+    case 2:
+        vchSig.back() = pchBadHashTypes[Rand64() % sizeof(pchBadHashTypes)];
+        break;
+    case 3:
+        vchSig.clear();
+        break;
+    case 4:
+        vchSig.insert(vchSig.end() - 1, 1 + Rand64() % 3, 0);
+        break;
+    case 5:
+        NegateS(vchSig);
+        break;
+    case 6:
+        vchSig = RandBytes(MAX_SCRIPT_ELEMENT_SIZE + RandChance(2));
+        break;
+    default:
+        vchSig = RandBytes(Rand64() % 80);
+        break;
+    }
+}
+
+static valtype PubKeyBytes(const CPubKey& pubkey)
+{
+    return valtype(pubkey.begin(), pubkey.end());
+}
+
+static valtype MutatePubKey(const CPubKey& pubkey)
+{
+    valtype vchPubKey = PubKeyBytes(pubkey);
+    if (!RandChance(4))
+        return vchPubKey;
+    switch (Rand64() % 6)
+    {
+    case 0:
+        // Hybrid encoding of an uncompressed key
+        if (vchPubKey.size() == 65)
+            vchPubKey[0] = 0x06 | (vchPubKey[64] & 1);
+        break;
+    case 1:
+        vchPubKey[Rand64() % vchPubKey.size()] ^= 1 << (Rand64() % 8);
+        break;
+    case 2:
+        vchPubKey.resize(Rand64() % vchPubKey.size());
+        break;
+    case 3:
+        vchPubKey.push_back(0);
+        break;
+    case 4:
+        vchPubKey = RandBytes(MAX_SCRIPT_ELEMENT_SIZE + RandChance(2));
+        break;
+    default:
+        vchPubKey[0] = Rand64() & 0xff;
+        break;
+    }
+    return vchPubKey;
+}
+
+static CScript MultisigScript(opcodetype opRequired, const vector<CScript>& vKeyPushes, opcodetype opKeys, const CScript& scriptTail)
+{
+    CScript script;
+    script << opRequired;
+    for (unsigned int i = 0; i < vKeyPushes.size(); i++)
+        script.insert(script.end(), vKeyPushes[i].begin(), vKeyPushes[i].end());
+    script << opKeys << OP_CHECKMULTISIG;
+    script.insert(script.end(), scriptTail.begin(), scriptTail.end());
+    return script;
+}
+
+static vector<CKey> vKeys;
+
+static CKey& RandKey()
+{
+    return vKeys[Rand64() % vKeys.size()];
+}
+
+static const unsigned int pnFlags[] = { SCRIPT_VERIFY_P2SH, SCRIPT_VERIFY_STRICTENC, SCRIPT_VERIFY_LOW_S, SCRIPT_VERIFY_NULLDUMMY };
+
+enum
+{
+    SPEND_P2PKH,
+    SPEND_P2PK,
+    SPEND_MULTISIG,
+    SPEND_TYPES
+};
+
+static const char* pszSpendNames[SPEND_TYPES] = { "P2PKH", "P2PK", "P2SH multisig" };
+
+static int nChecks = 0;
+static int nFailures = 0;
+static int nTaken[SPEND_TYPES][2];
+
+static void Check(bool fOk, const char* pszWhat, const CScript& scriptSig, const CScript& scriptPubKey, unsigned int flags)
+{
+    nChecks++;
+    if (fOk)
+        return;
+    if (++nFailures <= 20)
+        fprintf(stdout, "MISMATCH %s flags=%x\n  scriptSig: %s\n  scriptPubKey: %s\n", pszWhat, flags,
+            HexStr(scriptSig.begin(), scriptSig.end()).c_str(), HexStr(scriptPubKey.begin(), scriptPubKey.end()).c_str());
+}
+
+static void CheckSpend(int nType)
+{
+    // Nothing checks the prevout against the spent output, and the spent
+    // output can't be known before signing when a signature is part of it
+    CTransaction txTo;
+    txTo.vin.resize(1 + Rand64() % 3);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        uint64_t nPrevHash = Rand64();
+        txTo.vin[i].prevout = COutPoint(Hash(BEGIN(nPrevHash), END(nPrevHash)), Rand64() % 4);
+    }
+    txTo.vout.resize(1 + Rand64() % 2);
+    for (unsigned int i = 0; i < txTo.vout.size(); i++)
+    {
+        txTo.vout[i].nValue = 1 + Rand64() % COIN;
+        txTo.vout[i].scriptPubKey << OP_DUP << OP_HASH160 << RandBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+
+    unsigned int flags = SCRIPT_VERIFY_NOCACHE;
+    for (unsigned int i = 0; i < sizeof(pnFlags) / sizeof(pnFlags[0]); i++)
+        if (RandChance(2))
+            flags |= pnFlags[i];
+
+    CScript scriptPubKey;
+    vector<valtype> vPushes;
+    switch (nType)
+    {
+    case SPEND_P2PKH:
+    {
+        CKey& key = RandKey();
+        valtype vchPubKey = MutatePubKey(key.GetPubKey());
+        // Hash of the key pushed, of the key before it was broken or of another key
+        valtype vchHashed = RandChance(2) ? vchPubKey : PubKeyBytes((RandChance(4) ? RandKey() : key).GetPubKey());
+        uint160 hash = Hash160(vchHashed);
+        scriptPubKey << OP_DUP << OP_HASH160 << valtype(hash.begin(), hash.end()) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+        valtype vchSig = Sign(RandChance(8) ? RandKey() : key, scriptPubKey, txTo);
+        MutateSig(vchSig);
+        vPushes.push_back(vchSig);
+        vPushes.push_back(vchPubKey);
+        break;
+    }
+    case SPEND_P2PK:
+    {
+        CKey& key = RandKey();
+        Push(scriptPubKey, MutatePubKey(key.GetPubKey()));
+        scriptPubKey << OP_CHECKSIG;
+
+        valtype vchSig = Sign(RandChance(8) ? RandKey() : key, scriptPubKey, txTo);
+        MutateSig(vchSig);
+        vPushes.push_back(vchSig);
+        break;
+    }
+    default:
+    {
+        // OP_m <pubkey> ... <pubkey> OP_n OP_CHECKMULTISIG, now and then a
+        // large n, a wrong n or m, or trailing opcodes
+        unsigned int nKeys = RandChance(16) ? 1 + Rand64() % 16 : 1 + Rand64() % 4;
+        unsigned int nRequired = 1 + Rand64() % nKeys;
+        vector<CKey*> vScriptKeys;
+        vector<CScript> vKeyPushes(nKeys);
+        for (unsigned int i = 0; i < nKeys; i++)
+        {
+            vScriptKeys.push_back(&RandKey());
+            Push(vKeyPushes[i], MutatePubKey(vScriptKeys.back()->GetPubKey()));
+        }
+
+        // Signing keys in script order, sometimes shuffled, repeated or
+        // replaced by a key outside the script
+        vector<unsigned int> vSigners;
+        for (unsigned int i = 0; i < nKeys && vSigners.size() < nRequired; i++)
+            if (Rand64() % (nKeys - i) < nRequired - vSigners.size())
+                vSigners.push_back(i);
+        if (RandChance(6))
+            for (unsigned int i = vSigners.size(); i > 1; i--)
+                swap(vSigners[i - 1], vSigners[Rand64() % i]);
+        if (RandChance(12))
+            vSigners[Rand64() % vSigners.size()] = vSigners[Rand64() % vSigners.size()];
+
+        // Now and then the first signature also goes into the key list.
+        // FindAndDelete takes it out of the script code again, so all
+        // signatures are made over the script without it.
+        bool fSigInScript = nKeys < 16 && RandChance(8);
+        opcodetype opRequired = (opcodetype)(OP_1 - 1 + (RandChance(32) ? 1 + Rand64() % 16 : nRequired));
+        opcodetype opKeys = (opcodetype)(OP_1 - 1 + (RandChance(32) ? 1 + Rand64() % 16 : nKeys + fSigInScript));
+        CScript scriptTail;
+        if (RandChance(32))
+            scriptTail << (RandChance(2) ? OP_NOP : OP_1);
+
+        CScript scriptCode = MultisigScript(opRequired, vKeyPushes, opKeys, scriptTail);
+        valtype vchSigInScript;
+        if (fSigInScript)
+        {
+            vchSigInScript = Sign(*vScriptKeys[vSigners[0]], scriptCode, txTo);
+            CScript scriptPush;
+            Push(scriptPush, vchSigInScript);
+            vKeyPushes.insert(vKeyPushes.begin() + Rand64() % (nKeys + 1), scriptPush);
+        }
+        CScript redeemScript = MultisigScript(opRequired, vKeyPushes, opKeys, scriptTail);
+        if (RandChance(64))
+            redeemScript = CScript() << OP_1 << RandBytes(260) << RandBytes(260) << OP_2 << OP_CHECKMULTISIG;
+
+        valtype vchRedeemScript(redeemScript.begin(), redeemScript.end());
+        valtype vchHashed = RandChance(16) ? RandBytes(20) : vchRedeemScript;
+        uint160 hash = Hash160(vchHashed);
+        scriptPubKey << OP_HASH160 << valtype(hash.begin(), hash.end()) << OP_EQUAL;
+
+        valtype vchDummy;
+        if (RandChance(6))
+            vchDummy = RandChance(2) ? valtype(1, 0) : RandBytes(1 + Rand64() % 3);
+        vPushes.push_back(vchDummy);
+        for (unsigned int i = 0; i < vSigners.size(); i++)
+        {
+            valtype vchSig;
+            if (i == 0 && fSigInScript)
+                vchSig = vchSigInScript;
+            else if (RandChance(24))
+            {
+                // A key push as signature, FindAndDelete drops that key
+                const CScript& scriptPush = vKeyPushes[Rand64() % vKeyPushes.size()];
+                CScript::const_iterator pc = scriptPush.begin();
+                opcodetype opcode;
+                scriptPush.GetOp(pc, opcode, vchSig);
+            }
+            else
+            {
+                vchSig = Sign(RandChance(16) ? RandKey() : *vScriptKeys[vSigners[i]], scriptCode, txTo);
+                MutateSig(vchSig);
+            }
+            vPushes.push_back(vchSig);
+        }
+        if (RandChance(16))
+            vPushes.erase(vPushes.begin() + Rand64() % vPushes.size());
+        vPushes.push_back(vchRedeemScript);
+        break;
+    }
+    }
+
+    if (RandChance(16))
+        vPushes.insert(vPushes.begin() + Rand64() % (vPushes.size() + 1), RandBytes(Rand64() % 3));
+
+    CScript scriptSig;
+    for (unsigned int i = 0; i < vPushes.size(); i++)
+    {
+        if (RandChance(64))
+            scriptSig << (RandChance(2) ? OP_NOP : OP_1);
+        Push(scriptSig, vPushes[i]);
+    }
+    txTo.vin[0].scriptSig = scriptSig;
+
+    bool fInterpreter = VerifyScriptInterpreter(scriptSig, scriptPubKey, txTo, 0, flags, 0);
+    bool fFast = false;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, 0, flags, 0, NULL, fFast))
+    {
+        nTaken[nType][fFast]++;
+        Check(fFast == fInterpreter, pszSpendNames[nType], scriptSig, scriptPubKey, flags);
+    }
+    Check(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0) == fInterpreter, "VerifyScript", scriptSig, scriptPubKey, flags);
+}
+
+int main(int argc, char* argv[])
+{
+    int nIterations = argc > 1 ? atoi(argv[1]) : 20000;
+    nRandState = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (nRandState == 0)
+        nRandState = 1;
+
+    for (int i = 0; i < 12; i++)
+    {
+        vKeys.push_back(CKey());
+        vKeys.back().MakeNewKey(i % 2 == 0);
+    }
+
+    for (int i = 0; i < nIterations; i++)
+        CheckSpend(i % SPEND_TYPES);
+
+    // Every template has to have been taken by the fast path both ways
+    for (int nType = 0; nType < SPEND_TYPES; nType++)
+    {
+        fprintf(stdout, "%s: fast path passed %d, failed %d\n", pszSpendNames[nType], nTaken[nType][1], nTaken[nType][0]);
+        if (nTaken[nType][0] == 0 || nTaken[nType][1] == 0)
+            nFailures++;
+    }
+
+    fprintf(stdout, "%d checks, %d mismatches\n", nChecks, nFailures);
+    return nFailures == 0 ? 0 : 1;
+}
@@ -312,6 +312,7 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",         &signrawtransaction,          false,  false },
     { "sendrawtransaction",         &sendrawtransaction,          false,  false },
     { "getcheckpoint",              &getcheckpoint,               true,   false },
+    { "getcompressioninfo",         &getcompressioninfo,          true,   false },
     { "reservebalance",             &reservebalance,              false,  true},
     { "checkwallet",                &checkwallet,                 false,  true},
     { "repairwallet",               &repairwallet,                false,  true},
@@ -1223,6 +1224,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "getcompressioninfo"     && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getrawmempool"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "dumpblockbynumber"      && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 1) ConvertTo<bool>(params[1]);
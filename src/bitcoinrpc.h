@@ -245,5 +245,6 @@ extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, boo
 extern json_spirit::Value dumpblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getcompressioninfo(const json_spirit::Array& params, bool fHelp);
 
 #endif
@@ -81,14 +81,14 @@ namespace Checkpoints
         return checkpoints.rbegin()->second.second;
     }
 
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+    CBlockIndex* GetLastCheckpoint(const CBlockIndexMap& mapBlockIndex)
     {
         MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
 
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
         {
             const uint256& hash = i.second.first;
-            std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
+            CBlockIndexMap::const_iterator t = mapBlockIndex.find(hash);
             if (t != mapBlockIndex.end())
                 return t->second;
         }
@@ -130,10 +130,9 @@ namespace Checkpoints
             // Received an older checkpoint, trace back from current checkpoint
             // to the same height of the received checkpoint to verify
             // that current checkpoint should be a descendant block
-            CBlockIndex* pindex = pindexSyncCheckpoint;
-            while (pindex->nHeight > pindexCheckpointRecv->nHeight)
-                if ((pindex = pindex->pprev) == NULL)
-                    return error("ValidateSyncCheckpoint: pprev null - block index structure failure");
+            CBlockIndex* pindex = pindexSyncCheckpoint->GetAncestor(pindexCheckpointRecv->nHeight);
+            if (pindex == NULL)
+                return error("ValidateSyncCheckpoint: pprev null - block index structure failure");
             if (pindex->GetBlockHash() != hashCheckpoint)
             {
                 hashInvalidCheckpoint = hashCheckpoint;
@@ -145,10 +144,9 @@ namespace Checkpoints
         // Received checkpoint should be a descendant block of the current
         // checkpoint. Trace back to the same height of current checkpoint
         // to verify.
-        CBlockIndex* pindex = pindexCheckpointRecv;
-        while (pindex->nHeight > pindexSyncCheckpoint->nHeight)
-            if ((pindex = pindex->pprev) == NULL)
-                return error("ValidateSyncCheckpoint: pprev2 null - block index structure failure");
+        CBlockIndex* pindex = pindexCheckpointRecv->GetAncestor(pindexSyncCheckpoint->nHeight);
+        if (pindex == NULL)
+            return error("ValidateSyncCheckpoint: pprev2 null - block index structure failure");
         if (pindex->GetBlockHash() != hashSyncCheckpoint)
         {
             hashInvalidCheckpoint = hashCheckpoint;
@@ -247,10 +245,9 @@ namespace Checkpoints
         if (nHeight > pindexSync->nHeight)
         {
             // trace back to same height as sync-checkpoint
-            const CBlockIndex* pindex = pindexPrev;
-            while (pindex->nHeight > pindexSync->nHeight)
-                if ((pindex = pindex->pprev) == NULL)
-                    return error("CheckSync: pprev null - block index structure failure");
+            const CBlockIndex* pindex = pindexPrev->GetAncestor(pindexSync->nHeight);
+            if (pindex == NULL)
+                return error("CheckSync: pprev null - block index structure failure");
             if (pindex->nHeight < pindexSync->nHeight || pindex->GetBlockHash() != hashSyncCheckpoint)
                 return false; // only descendant of sync-checkpoint can pass check
         }
@@ -19,6 +19,7 @@ static const int64_t CHECKPOINT_MAX_SPAN = nOneHour;
 
 class uint256;
 class CBlockIndex;
+class CBlockIndexMap;
 class CSyncCheckpoint;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
@@ -47,7 +48,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const CBlockIndexMap& mapBlockIndex);
 
     // Returns last checkpoint timestamp
     unsigned int GetLastCheckpointTime();
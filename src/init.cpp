@@ -90,7 +90,20 @@ void Shutdown(void* parg)
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+        if (GetBoolArg("-persistmempool", true))
+            DumpMempool();
+#ifdef USE_LEVELDB
+        {
+            LOCK(cs_main);
+            CTxDB().Flush();
+        }
+#endif
         bitdb.Flush(true);
+        {
+            LOCK(cs_main);
+            WriteBlockIndexSnapshot();
+        }
+        CloseBlockFiles();
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
         delete pwalletMain;
@@ -238,6 +251,7 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -txcache=<n>           " + _("Set transaction index write-back cache size in megabytes (default: 64)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -301,7 +315,15 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -prune=<n>             " + _("Keep block files within <n> megabytes by pruning old blocks, at least 512 (default: 0 = off)") + "\n" +
+        "  -compressblocks        " + _("Store new blocks compressed (default: 0)") + "\n" +
         "  -par=N                 " + _("Set the number of script verification threads (1-16, 0=auto, default: 0)") + "\n" +
+        "  -headersfirst          " + _("Download block headers first and fetch blocks from several peers at once (default: 1)") + "\n" +
+        "  -maxorphanblocksize=<n> " + _("Keep at most <n> megabytes of orphan blocks in memory, move the rest to disk (default: 32)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Do not keep transactions in the memory pool longer than <n> hours (default: 72)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on the next start (default: 1)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Use at most <n> megabytes for the signature cache (0-256, default: 32)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
@@ -377,6 +399,21 @@ bool AppInit2()
 
     nNodeLifespan = GetArgUInt("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    nMaxOrphanBlockBytes = (uint64_t)max(1, GetArgInt("-maxorphanblocksize", 32)) << 20;
+    nMaxMempoolBytes = (uint64_t)max(5, GetArgInt("-maxmempool", 300)) << 20;
+    nMempoolExpiry = (int64_t)max(1, GetArgInt("-mempoolexpiry", 72)) * 60 * 60;
+
+    nPruneTarget = (uint64_t)max(0, GetArgInt("-prune", 0)) << 20;
+    if (nPruneTarget)
+    {
+        if (nPruneTarget < MIN_PRUNE_TARGET)
+            return InitError(strprintf(_("-prune must be at least %d megabytes"), (int)(MIN_PRUNE_TARGET >> 20)));
+        fPruneMode = true;
+        // Old blocks can't be served any more
+        nLocalServices &= ~NODE_NETWORK;
+    }
+    fCompressBlocks = GetBoolArg("-compressblocks", false);
     fUseMemoryLog = GetBoolArg("-memorylog", true);
 
     // Ping and address broadcast intervals
@@ -562,9 +599,15 @@ bool AppInit2()
     if (nScriptCheckThreads) {
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
+        {
             NewThread(ThreadScriptCheck, NULL);
+            NewThread(ThreadBlockCheck, NULL);
+        }
     }
 
+    // Commit block file writes to disk in the background
+    NewThread(ThreadFlushBlockFiles, NULL);
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -812,7 +855,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -831,6 +874,10 @@ bool AppInit2()
         return false;
     }
 
+    // Keep block files within the -prune budget in the background
+    if (fPruneMode)
+        NewThread(ThreadPruneBlockFiles, NULL);
+
     // ********************************************************* Step 8: load wallet
 
     if (GetBoolArg("-zapwallettxes", false)) {
@@ -927,6 +974,8 @@ bool AppInit2()
     }
     if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
+        if (pindexRescan->IsPruned())
+            return InitError(_("Rescanning the wallet needs blocks that have been pruned."));
         uiInterface.InitMessage(_("Rescanning..."));
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
@@ -961,6 +1010,13 @@ bool AppInit2()
         }
     }
 
+    if (GetBoolArg("-persistmempool", true))
+    {
+        uiInterface.InitMessage(_("Loading memory pool..."));
+        printf("Loading memory pool...\n");
+        LoadMempool();
+    }
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
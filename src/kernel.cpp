@@ -306,11 +306,49 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
     return true;
 }
 
+// Resolved kernel stake modifiers by hashBlockFrom. An entry depends on the
+// main chain blocks from the coin's block up to nHeightEnd.
+struct CStakeModifierCacheEntry
+{
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    int nHeightEnd;
+};
+
+static const unsigned int MAX_STAKE_MODIFIER_CACHE = 50000;
+static CCriticalSection cs_mapStakeModifierCache;
+static map<uint256, CStakeModifierCacheEntry> mapStakeModifierCache;
+
+void InvalidateStakeModifierCache(int nHeight)
+{
+    LOCK(cs_mapStakeModifierCache);
+    map<uint256, CStakeModifierCacheEntry>::iterator it = mapStakeModifierCache.begin();
+    while (it != mapStakeModifierCache.end())
+    {
+        if ((*it).second.nHeightEnd > nHeight)
+            mapStakeModifierCache.erase(it++);
+        else
+            it++;
+    }
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
+    {
+        LOCK(cs_mapStakeModifierCache);
+        map<uint256, CStakeModifierCacheEntry>::const_iterator it = mapStakeModifierCache.find(hashBlockFrom);
+        if (it != mapStakeModifierCache.end())
+        {
+            nStakeModifier = (*it).second.nStakeModifier;
+            nStakeModifierHeight = (*it).second.nStakeModifierHeight;
+            nStakeModifierTime = (*it).second.nStakeModifierTime;
+            return true;
+        }
+    }
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
@@ -337,6 +375,23 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    {
+        LOCK(cs_mapStakeModifierCache);
+        if (mapStakeModifierCache.size() >= MAX_STAKE_MODIFIER_CACHE)
+        {
+            // Evict a random entry
+            map<uint256, CStakeModifierCacheEntry>::iterator it = mapStakeModifierCache.lower_bound(GetRandHash());
+            if (it == mapStakeModifierCache.end())
+                it = mapStakeModifierCache.begin();
+            mapStakeModifierCache.erase(it);
+        }
+        CStakeModifierCacheEntry& entry = mapStakeModifierCache[hashBlockFrom];
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
+        entry.nHeightEnd = pindex->nHeight;
+    }
     return true;
 }
 
@@ -515,11 +570,12 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
 uint32_t GetStakeModifierChecksum(const CBlockIndex* pindex)
 {
     assert (pindex->pprev || pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
-    // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
+    // Hash previous checksum with flags, hashProofOfStake and nStakeModifier.
+    // Pruning is local storage state and stays out of the checksum.
     CDataStream ss(SER_GETHASH, 0);
     if (pindex->pprev)
         ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    ss << (uint32_t)(pindex->nFlags & ~CBlockIndex::BLOCK_PRUNED) << pindex->hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return static_cast<uint32_t>(hashChecksum.Get64());
@@ -12,8 +12,10 @@
 #include "checkqueue.h"
 #include "kernel.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <zlib.h>
 
 #include "main.h"
 
@@ -30,7 +32,7 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
@@ -58,14 +60,33 @@ uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+uint64_t nMaxOrphanBlockBytes = 32 * 1024 * 1024;
+uint64_t nMaxMempoolBytes = 300 * 1024 * 1024;
+int64_t nMempoolExpiry = 72 * 60 * 60;
+bool fHeadersFirst = true;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+bool fCompressBlocks = false;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, uint256> mapProofOfStake;
 
+// Headers-first download: hashes of the sync node's header chain ahead of
+// pindexBest, vHeaderChain[0] is at height nHeaderChainStart. The headers
+// are kept as block index entries linked to pindexBest, so the difficulty
+// each one requires can be computed.
+static vector<uint256> vHeaderChain;
+static int nHeaderChainStart = 0;
+static map<uint256, CBlockIndex> mapHeaderChain;
+// Peer the header chain came from, referenced as long as the chain is kept
+static CNode* pnodeHeaderChain = NULL;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -477,7 +498,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     const CBlockIndex* pindex = (*mi).second;
@@ -597,7 +618,7 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree, enum G
 
 
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, std::vector<CScriptCheck>* pvChecks)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -639,6 +660,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
     // Check for conflicts with in-memory transactions
     CTransaction* ptxOld = NULL;
+    CTxMemPoolEntry entry;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -697,6 +719,13 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                          hash.ToString().c_str(),
                          nFees, txMinFee);
 
+        // After evictions the pool asks for more than what it evicted
+        double dMinFeePerKb = GetMinFeePerKb();
+        if (dMinFeePerKb > 0 && double(nFees) / (double(nSize) / 1000.0) < dMinFeePerKb)
+            return error("CTxMemPool::accept() : memory pool min fee not met %s, %.1f < %.1f per kB",
+                         hash.ToString().substr(0,10).c_str(),
+                         double(nFees) / (double(nSize) / 1000.0), dMinFeePerKb);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -724,10 +753,13 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, STRICT_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, STRICT_FLAGS, pvChecks))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+
+        // Score it for block assembly while the inputs are at hand
+        entry = CTxMemPoolEntry(tx, mapInputs, pindexBest ? pindexBest->nHeight : 0, true);
     }
 
     // Store transaction in memory
@@ -738,7 +770,18 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, fCheckInputs ? &entry : NULL);
+
+        // Keep the pool within its limits, this may evict the new transaction
+        // if its fee rate is the lowest. With deferred script checks the fee
+        // isn't proven yet, acceptBatch() trims once the scripts are checked.
+        if (!pvChecks)
+        {
+            expire(GetTime() - nMempoolExpiry);
+            trimToSize(nMaxMempoolBytes);
+            if (!mapTx.count(hash))
+                return error("CTxMemPool::accept() : memory pool full, fee rate of %s too low", hash.ToString().substr(0,10).c_str());
+        }
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -752,12 +795,97 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     return true;
 }
 
+void CTxMemPool::acceptBatch(CTxDB& txdb, const vector<CTransaction*>& vptx, vector<int>& vResult)
+{
+    vResult.assign(vptx.size(), BATCH_REJECTED);
+
+    LOCK(cs);
+    bool fDeferScripts = nScriptCheckThreads > 0 && vptx.size() > 1;
+    vector<vector<CScriptCheck> > vTxChecks(vptx.size());
+    vector<unsigned int> vAccepted;
+    for (unsigned int i = 0; i < vptx.size(); i++)
+    {
+        bool fMissingInputs = false;
+        if (accept(txdb, *vptx[i], true, &fMissingInputs, fDeferScripts ? &vTxChecks[i] : NULL))
+        {
+            vResult[i] = BATCH_ACCEPTED;
+            vAccepted.push_back(i);
+        }
+        else if (fMissingInputs)
+            vResult[i] = BATCH_MISSING_INPUTS;
+    }
+
+    if (!fDeferScripts || vAccepted.empty())
+        return;
+
+    bool fAllOk;
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        BOOST_FOREACH(unsigned int i, vAccepted)
+        {
+            // the queue takes the checks by swapping, keep ours
+            vector<CScriptCheck> vChecks(vTxChecks[i]);
+            control.Add(vChecks);
+        }
+        fAllOk = control.Wait();
+    }
+
+    // Find the transactions that failed. They leave the pool together with
+    // whatever spends from them, and get the DoS score ConnectInputs() would
+    // have given them.
+    if (!fAllOk)
+    {
+        BOOST_FOREACH(unsigned int i, vAccepted)
+        {
+            CTransaction& tx = *vptx[i];
+            uint256 hash = tx.GetHash();
+            if (!mapTx.count(hash))
+            {
+                // an ancestor failed, as if it had never arrived
+                vResult[i] = BATCH_MISSING_INPUTS;
+                continue;
+            }
+
+            const CScriptCheck* pcheckFailed = NULL;
+            BOOST_FOREACH(const CScriptCheck& check, vTxChecks[i])
+            {
+                if (!check())
+                {
+                    pcheckFailed = &check;
+                    break;
+                }
+            }
+            if (!pcheckFailed)
+                continue;
+
+            removeWithDescendants(hash);
+            vResult[i] = BATCH_REJECTED;
+            // Don't trigger DoS code in case of STRICT_FLAGS caused failure
+            if (pcheckFailed->IsStrictOnlyFailure())
+                error("CTxMemPool::acceptBatch() : %s strict VerifySignature failed", hash.ToString().substr(0,10).c_str());
+            else
+                tx.DoS(100, error("CTxMemPool::acceptBatch() : %s VerifySignature failed", hash.ToString().substr(0,10).c_str()));
+        }
+    }
+
+    // Now that the fees are proven, keep the pool within its limits
+    expire(GetTime() - nMempoolExpiry);
+    trimToSize(nMaxMempoolBytes);
+    BOOST_FOREACH(unsigned int i, vAccepted)
+    {
+        if (vResult[i] != BATCH_ACCEPTED || mapTx.count(vptx[i]->GetHash()))
+            continue;
+        vResult[i] = BATCH_REJECTED;
+        error("CTxMemPool::acceptBatch() : memory pool full, fee rate of %s too low", vptx[i]->GetHash().ToString().substr(0,10).c_str());
+    }
+}
+
 bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMissingInputs)
 {
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry* pentry)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -765,11 +893,88 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        addEntry(hash, pentry ? *pentry : CTxMemPoolEntry(tx));
         nTransactionsUpdated++;
     }
     return true;
 }
 
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& tx)
+{
+    nFee = 0;
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nSigOps = tx.GetLegacySigOpCount();
+    nValueInChain = 0;
+    dPriority = 0;
+    nHeight = 0;
+    nTime = GetTime();
+    fScored = false;
+    fScriptChecked = false;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& tx, const MapPrevTx& mapInputs, int nHeightIn, bool fScriptCheckedIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+    nSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(mapInputs);
+    nValueInChain = 0;
+    dPriority = 0;
+    nHeight = nHeightIn;
+    nTime = GetTime();
+    fScored = true;
+    fScriptChecked = fScriptCheckedIn;
+
+    // Priority is sum(valuein * age) / txsize, inputs from the memory pool
+    // have no age yet
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+        if (mi == mapInputs.end())
+            continue;
+        const CTxIndex& txindex = (*mi).second.first;
+        if (txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        int64_t nValueIn = (*mi).second.second.vout[txin.prevout.n].nValue;
+        nValueInChain += nValueIn;
+        dPriority += (double)nValueIn * txindex.GetDepthInMainChain();
+    }
+    dPriority /= nTxSize;
+}
+
+const CTxMemPoolEntry& CTxMemPool::addEntry(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi != mapEntry.end())
+    {
+        // Scoring a transaction later keeps its place in the pool
+        CTxMemPoolEntry& entryOld = (*mi).second;
+        setByFeeRate.erase(make_pair(entryOld.GetFeePerKb(), hash));
+        nTotalTxSize -= entryOld.nTxSize;
+        int64_t nTime = entryOld.nTime;
+        entryOld = entry;
+        entryOld.nTime = nTime;
+    }
+    else
+    {
+        mi = mapEntry.insert(make_pair(hash, entry)).first;
+        setByTime.insert(make_pair(entry.nTime, hash));
+    }
+    // Unscored entries have no fee and rank lowest
+    setByFeeRate.insert(make_pair(entry.GetFeePerKb(), hash));
+    nTotalTxSize += entry.nTxSize;
+    return (*mi).second;
+}
+
+const CTxMemPoolEntry* CTxMemPool::getEntry(const uint256& hash) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return NULL;
+    return &(*mi).second;
+}
+
 
 bool CTxMemPool::remove(CTransaction &tx)
 {
@@ -782,17 +987,230 @@ bool CTxMemPool::remove(CTransaction &tx)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                const CTxMemPoolEntry& entry = (*mi).second;
+                setByFeeRate.erase(make_pair(entry.GetFeePerKb(), hash));
+                setByTime.erase(make_pair(entry.nTime, hash));
+                nTotalTxSize -= entry.nTxSize;
+                mapEntry.erase(mi);
+            }
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+bool CTxMemPool::removeWithDescendants(const uint256& hash)
+{
+    LOCK(cs);
+    if (!mapTx.count(hash))
+        return false;
+
+    set<uint256> setRemove;
+    calculateDescendants(hash, setRemove);
+    setRemove.insert(hash);
+    BOOST_FOREACH(const uint256& hashRemove, setRemove)
+    {
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hashRemove);
+        if (mi == mapTx.end())
+            continue;
+        // remove() erases the map element the reference points to
+        CTransaction tx = (*mi).second;
+        remove(tx);
+    }
+    return true;
+}
+
+void CTxMemPool::calculateAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    LOCK(cs);
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        map<uint256, CTransaction>::const_iterator mi = mapTx.find(vWork.back());
+        vWork.pop_back();
+        if (mi == mapTx.end())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, (*mi).second.vin)
+            if (mapTx.count(txin.prevout.hash) && setAncestors.insert(txin.prevout.hash).second)
+                vWork.push_back(txin.prevout.hash);
+    }
+}
+
+void CTxMemPool::calculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    LOCK(cs);
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        uint256 hashWork = vWork.back();
+        vWork.pop_back();
+        map<uint256, CTransaction>::const_iterator mi = mapTx.find(hashWork);
+        if (mi == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < (*mi).second.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hashWork, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashSpender = (*it).second.ptx->GetHash();
+            if (setDescendants.insert(hashSpender).second)
+                vWork.push_back(hashSpender);
+        }
+    }
+}
+
+void CTxMemPool::getAncestorStats(const uint256& hash, unsigned int& nCount, uint64_t& nSize, int64_t& nFees) const
+{
+    LOCK(cs);
+    set<uint256> setAncestors;
+    calculateAncestors(hash, setAncestors);
+    setAncestors.insert(hash);
+
+    nCount = 0;
+    nSize = 0;
+    nFees = 0;
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashAncestor);
+        if (mi == mapEntry.end())
+            continue;
+        nCount++;
+        nSize += (*mi).second.nTxSize;
+        nFees += (*mi).second.nFee;
+    }
+}
+
+void CTxMemPool::getDescendantStats(const uint256& hash, unsigned int& nCount, uint64_t& nSize, int64_t& nFees) const
+{
+    LOCK(cs);
+    set<uint256> setDescendants;
+    calculateDescendants(hash, setDescendants);
+    setDescendants.insert(hash);
+
+    nCount = 0;
+    nSize = 0;
+    nFees = 0;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashDescendant);
+        if (mi == mapEntry.end())
+            continue;
+        nCount++;
+        nSize += (*mi).second.nTxSize;
+        nFees += (*mi).second.nFee;
+    }
+}
+
+void CTxMemPool::setEntryTime(const uint256& hash, int64_t nTime)
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    setByTime.erase(make_pair((*mi).second.nTime, hash));
+    (*mi).second.nTime = nTime;
+    setByTime.insert(make_pair(nTime, hash));
+}
+
+unsigned int CTxMemPool::expire(int64_t nTimeCutoff)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (!setByTime.empty() && setByTime.begin()->first < nTimeCutoff)
+    {
+        size_t nSizeBefore = mapTx.size();
+        uint256 hash = setByTime.begin()->second;
+        if (!removeWithDescendants(hash))
+            setByTime.erase(setByTime.begin());
+        nRemoved += nSizeBefore - mapTx.size();
+    }
+    if (nRemoved)
+        printf("CTxMemPool::expire() : removed %u transactions\n", nRemoved);
+    return nRemoved;
+}
+
+// Candidates looked at for each eviction, in order of their own fee rate
+static const unsigned int MAX_TRIM_CANDIDATES = 100;
+static const int64_t ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
+
+unsigned int CTxMemPool::trimToSize(uint64_t nMaxBytes)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    double dMaxFeePerKb = 0;
+
+    // Transactions that were never scored, like those put back by a
+    // reorganization, count as paying no fee and go first. Spending
+    // transactions go along with what they spend. A transaction is ranked by
+    // the better of its own fee rate and that of its descendant package, so
+    // a parent paid for by its children stays. That score is never below the
+    // own fee rate, which setByFeeRate is ordered by, so the search can stop
+    // at the first own fee rate above the lowest score found.
+    while (nTotalTxSize > nMaxBytes && !setByFeeRate.empty())
+    {
+        set<pair<double, uint256> >::iterator itEvict = setByFeeRate.begin();
+        double dEvictFeePerKb = 0;
+        unsigned int nCandidates = 0;
+        for (set<pair<double, uint256> >::iterator it = setByFeeRate.begin(); it != setByFeeRate.end(); ++it)
+        {
+            if (nCandidates > 0 && (it->first >= dEvictFeePerKb || nCandidates >= MAX_TRIM_CANDIDATES))
+                break;
+            unsigned int nCount;
+            uint64_t nSize;
+            int64_t nFees;
+            getDescendantStats(it->second, nCount, nSize, nFees);
+            double dScore = std::max(it->first, nSize ? double(nFees) / (double(nSize) / 1000.0) : 0.0);
+            if (nCandidates++ == 0 || dScore < dEvictFeePerKb)
+            {
+                itEvict = it;
+                dEvictFeePerKb = dScore;
+            }
+        }
+
+        size_t nSizeBefore = mapTx.size();
+        if (!removeWithDescendants(itEvict->second))
+            setByFeeRate.erase(itEvict);
+        nRemoved += nSizeBefore - mapTx.size();
+        dMaxFeePerKb = std::max(dMaxFeePerKb, dEvictFeePerKb);
+    }
+    if (nRemoved)
+    {
+        // What comes in next has to pay more than what was evicted
+        GetMinFeePerKb();
+        dRollingMinFeePerKb = std::max(dRollingMinFeePerKb, dMaxFeePerKb + MIN_RELAY_TX_FEE);
+        printf("CTxMemPool::trimToSize() : removed %u transactions, package fee rate up to %.1f per kB, minimum fee now %.1f per kB\n",
+            nRemoved, dMaxFeePerKb, dRollingMinFeePerKb);
+    }
+    return nRemoved;
+}
+
+double CTxMemPool::GetMinFeePerKb()
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    if (dRollingMinFeePerKb > 0 && nNow > nLastRollingFeeUpdate)
+    {
+        dRollingMinFeePerKb *= pow(0.5, double(nNow - nLastRollingFeeUpdate) / ROLLING_FEE_HALFLIFE);
+        if (dRollingMinFeePerKb < MIN_RELAY_TX_FEE / 2)
+            dRollingMinFeePerKb = 0;
+    }
+    nLastRollingFeeUpdate = nNow;
+    return dRollingMinFeePerKb;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByFeeRate.clear();
+    setByTime.clear();
+    nTotalTxSize = 0;
+    dRollingMinFeePerKb = 0;
     ++nTransactionsUpdated;
 }
 
@@ -815,7 +1233,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -898,7 +1316,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -945,22 +1363,89 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Blocks of the main chain indexed by height, kept in sync with the pnext links
+static vector<CBlockIndex*> vMainChain;
+
+void SetMainChainTip(CBlockIndex* pindexNew)
+{
+    if (!pindexNew)
+    {
+        vMainChain.clear();
+        InvalidateStakeModifierCache(-1);
+        return;
+    }
+    int nHeightOldTip = (int)vMainChain.size() - 1;
+    vMainChain.resize(pindexNew->nHeight + 1);
+    CBlockIndex* pindex = pindexNew;
+    for ( ; pindex && vMainChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vMainChain[pindex->nHeight] = pindex;
+
+    // Blocks above the fork left the main chain
+    int nHeightFork = pindex ? pindex->nHeight : -1;
+    if (nHeightFork < nHeightOldTip)
+        InvalidateStakeModifierCache(nHeightFork);
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vMainChain.size())
+        return NULL;
+    return vMainChain[nHeight];
+}
+
+// Turn the lowest set bit of n off
+static inline int InvertLowestOne(int n)
+{
+    return n & (n - 1);
+}
+
+// Height the skip pointer of a block at nHeight points to. Any height can be
+// reached from any higher one in O(log n) skip and pprev steps.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    // Odd heights skip a little less far back than even ones
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nAncestorHeight)
+{
+    if (nAncestorHeight > nHeight || nAncestorHeight < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (pindexWalk && nHeightWalk > nAncestorHeight)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nAncestorHeight ||
+             (nHeightSkip > nAncestorHeight && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nAncestorHeight))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nAncestorHeight) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nAncestorHeight);
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -970,6 +1455,8 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
         *this = pindex->GetBlockHeader();
         return true;
     }
+    if (pindex->IsPruned())
+        return error("CBlock::ReadFromDisk() : block %s is pruned", pindex->GetBlockHash().ToString().substr(0,20).c_str());
     if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
         return false;
     if (GetHash() != pindex->GetBlockHash())
@@ -994,6 +1481,246 @@ uint256 WantedByOrphan(const CBlock* pblockOrphan)
     return pblockOrphan->hashPrevBlock;
 }
 
+//
+// Orphan block pool. Above the memory limit the transactions of the orphans
+// furthest ahead of the chain are moved to a temporary file; their headers
+// stay in mapOrphanBlocks so the orphan chains can still be followed.
+//
+struct COrphanBlockInfo
+{
+    int64_t nTimeReceived;
+    unsigned int nSize;
+    int64_t nSpillPos; // -1 while the transactions are in memory
+    pair<COutPoint, unsigned int> proofOfStake;
+};
+
+static const int64_t ORPHAN_BLOCK_EXPIRY = 2 * nOneHour;
+static map<uint256, COrphanBlockInfo> mapOrphanBlockInfo;
+static uint64_t nOrphanBlockBytes = 0;
+static uint64_t nOrphanBlockSpillBytes = 0;
+static unsigned int nOrphanBlocksSpilled = 0;
+static FILE* fileOrphanSpill = NULL;
+static int64_t nOrphanSpillEnd = 0;
+
+static boost::filesystem::path GetOrphanSpillPath()
+{
+    return GetDataDir() / "orphanblocks.tmp";
+}
+
+static void AddOrphanBlock(const uint256& hash, CBlock* pblock)
+{
+    mapOrphanBlocks.insert(make_pair(hash, pblock));
+    mapOrphanBlocksByPrev.insert(make_pair(pblock->hashPrevBlock, pblock));
+
+    COrphanBlockInfo& info = mapOrphanBlockInfo[hash];
+    info.nTimeReceived = GetTime();
+    info.nSize = ::GetSerializeSize(*pblock, SER_DISK, CLIENT_VERSION);
+    info.nSpillPos = -1;
+    info.proofOfStake = pblock->GetProofOfStake();
+    nOrphanBlockBytes += info.nSize;
+}
+
+// Update the accounting for an orphan leaving the pool
+static void ForgetOrphanBlock(const uint256& hash)
+{
+    map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.find(hash);
+    if (it == mapOrphanBlockInfo.end())
+        return;
+    const COrphanBlockInfo& info = (*it).second;
+    setStakeSeenOrphan.erase(info.proofOfStake);
+    if (info.nSpillPos < 0)
+        nOrphanBlockBytes -= info.nSize;
+    else
+    {
+        nOrphanBlockSpillBytes -= info.nSize;
+        nOrphanBlocksSpilled--;
+    }
+    mapOrphanBlockInfo.erase(it);
+
+    // Start the spill file over once nothing refers to it
+    if (nOrphanBlocksSpilled == 0 && fileOrphanSpill)
+    {
+        fclose(fileOrphanSpill);
+        fileOrphanSpill = NULL;
+        nOrphanSpillEnd = 0;
+        boost::filesystem::remove(GetOrphanSpillPath());
+    }
+}
+
+static void EraseOrphanBlock(const uint256& hash)
+{
+    map<uint256, CBlock*>::iterator it = mapOrphanBlocks.find(hash);
+    if (it == mapOrphanBlocks.end())
+        return;
+    CBlock* pblock = (*it).second;
+    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(pblock->hashPrevBlock);
+         mi != mapOrphanBlocksByPrev.upper_bound(pblock->hashPrevBlock); ++mi)
+    {
+        if ((*mi).second == pblock)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    mapOrphanBlocks.erase(it);
+    ForgetOrphanBlock(hash);
+    delete pblock;
+}
+
+// Move the spilled orphans down over the space left by erased ones. New
+// spills are appended, so without this the file would keep growing as long
+// as some orphan stays on disk.
+static bool CompactOrphanSpill()
+{
+    vector<pair<int64_t, COrphanBlockInfo*> > vSpilled;
+    for (map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.begin(); it != mapOrphanBlockInfo.end(); it++)
+        if ((*it).second.nSpillPos >= 0)
+            vSpilled.push_back(make_pair((*it).second.nSpillPos, &(*it).second));
+    sort(vSpilled.begin(), vSpilled.end());
+
+    // Records only ever move towards the start, so each one is read before
+    // anything is written over it
+    int64_t nPos = 0;
+    vector<char> vBuf;
+    for (unsigned int i = 0; i < vSpilled.size(); i++)
+    {
+        COrphanBlockInfo& info = *vSpilled[i].second;
+        if (info.nSpillPos != nPos)
+        {
+            vBuf.resize(info.nSize);
+            if (fseek(fileOrphanSpill, info.nSpillPos, SEEK_SET) != 0 || fread(&vBuf[0], 1, info.nSize, fileOrphanSpill) != info.nSize)
+                return error("CompactOrphanSpill() : read failed");
+            if (fseek(fileOrphanSpill, nPos, SEEK_SET) != 0 || fwrite(&vBuf[0], 1, info.nSize, fileOrphanSpill) != info.nSize)
+                return error("CompactOrphanSpill() : write failed");
+            info.nSpillPos = nPos;
+        }
+        nPos += info.nSize;
+    }
+    fflush(fileOrphanSpill);
+
+    printf("CompactOrphanSpill() : %" PRId64 " -> %" PRId64 " bytes\n", nOrphanSpillEnd, nPos);
+    nOrphanSpillEnd = nPos;
+    try {
+        boost::filesystem::resize_file(GetOrphanSpillPath(), nPos);
+    } catch (const boost::filesystem::filesystem_error&) {
+        // The tail is overwritten by the next spills anyway
+    }
+    return true;
+}
+
+static bool SpillOrphanBlock(const uint256& hash, CBlock* pblock)
+{
+    COrphanBlockInfo& info = mapOrphanBlockInfo[hash];
+    if (!fileOrphanSpill)
+    {
+        fileOrphanSpill = fopen(GetOrphanSpillPath().string().c_str(), "w+b");
+        if (!fileOrphanSpill)
+            return error("SpillOrphanBlock() : open failed");
+        nOrphanSpillEnd = 0;
+    }
+    // Compact once the holes outgrow both the live data and the memory limit
+    if ((uint64_t)nOrphanSpillEnd - nOrphanBlockSpillBytes > max(nOrphanBlockSpillBytes, nMaxOrphanBlockBytes))
+        if (!CompactOrphanSpill())
+            return false;
+    if (fseek(fileOrphanSpill, nOrphanSpillEnd, SEEK_SET) != 0)
+        return error("SpillOrphanBlock() : seek failed");
+    CAutoFile fileout = CAutoFile(fileOrphanSpill, SER_DISK, CLIENT_VERSION);
+    try {
+        fileout << *pblock;
+    }
+    catch (const std::exception&) {
+        fileout.release();
+        return error("SpillOrphanBlock() : I/O error");
+    }
+    fileout.release();
+
+    info.nSpillPos = nOrphanSpillEnd;
+    nOrphanSpillEnd += info.nSize;
+    nOrphanBlockBytes -= info.nSize;
+    nOrphanBlockSpillBytes += info.nSize;
+    nOrphanBlocksSpilled++;
+
+    // Keep the header only
+    vector<CTransaction>().swap(pblock->vtx);
+    vector<uint256>().swap(pblock->vMerkleTree);
+    vector<unsigned char>().swap(pblock->vchBlockSig);
+    return true;
+}
+
+// Bring back the transactions of an orphan moved to disk
+static bool ReadOrphanBlock(const uint256& hash, CBlock* pblock)
+{
+    map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.find(hash);
+    if (it == mapOrphanBlockInfo.end() || (*it).second.nSpillPos < 0)
+        return true;
+    if (!fileOrphanSpill || fseek(fileOrphanSpill, (*it).second.nSpillPos, SEEK_SET) != 0)
+        return error("ReadOrphanBlock() : seek failed");
+    CAutoFile filein = CAutoFile(fileOrphanSpill, SER_DISK, CLIENT_VERSION);
+    try {
+        filein >> *pblock;
+    }
+    catch (const std::exception&) {
+        filein.release();
+        return error("ReadOrphanBlock() : I/O error");
+    }
+    filein.release();
+    if (pblock->GetHash() != hash)
+        return error("ReadOrphanBlock() : hash mismatch");
+    return true;
+}
+
+// Drop expired orphans, then move the ones furthest ahead of the chain to
+// disk until the memory limit is met, then drop spilled ones the same way
+static void LimitOrphanBlocks()
+{
+    int64_t nNow = GetTime();
+    vector<uint256> vErase;
+    vector<pair<unsigned int, uint256> > vInMemory, vSpilled;
+    for (map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.begin(); it != mapOrphanBlockInfo.end(); it++)
+    {
+        const uint256& hash = (*it).first;
+        if (nNow - (*it).second.nTimeReceived > ORPHAN_BLOCK_EXPIRY)
+            vErase.push_back(hash);
+        else if ((*it).second.nSpillPos < 0)
+            vInMemory.push_back(make_pair(mapOrphanBlocks[hash]->nTime, hash));
+        else
+            vSpilled.push_back(make_pair(mapOrphanBlocks[hash]->nTime, hash));
+    }
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanBlock(hash);
+
+    sort(vInMemory.begin(), vInMemory.end());
+    while (nOrphanBlockBytes > nMaxOrphanBlockBytes && !vInMemory.empty())
+    {
+        const uint256& hash = vInMemory.back().second;
+        if (SpillOrphanBlock(hash, mapOrphanBlocks[hash]))
+            vSpilled.push_back(vInMemory.back());
+        else
+            EraseOrphanBlock(hash);
+        vInMemory.pop_back();
+    }
+
+    sort(vSpilled.begin(), vSpilled.end());
+    while (nOrphanBlockSpillBytes > 8 * nMaxOrphanBlockBytes && !vSpilled.empty())
+    {
+        EraseOrphanBlock(vSpilled.back().second);
+        vSpilled.pop_back();
+    }
+
+    if (!vErase.empty() || nOrphanBlocksSpilled > 0)
+        printf("LimitOrphanBlocks() : %" PRIszu " orphans, %" PRIszu " expired, %u on disk (%" PRIu64 " bytes)\n",
+            mapOrphanBlocks.size(), vErase.size(), nOrphanBlocksSpilled, nOrphanBlockSpillBytes);
+}
+
+void GetOrphanBlockStats(unsigned int& nCount, unsigned int& nSpilled, uint64_t& nBytes, uint64_t& nSpillBytes)
+{
+    LOCK(cs_main);
+    nCount = mapOrphanBlocks.size();
+    nSpilled = nOrphanBlocksSpilled;
+    nBytes = nOrphanBlockBytes;
+    nSpillBytes = nOrphanBlockSpillBytes;
+}
+
 // select stake target limit according to hard-coded conditions
 CBigNum inline GetProofOfStakeLimit(int nHeight, unsigned int nTime)
 {
@@ -1434,11 +2161,18 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
     return true;
 }
 
+bool CScriptCheck::IsStrictOnlyFailure() const {
+    if (!(nFlags & STRICT_FLAGS))
+        return false;
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags & ~STRICT_FLAGS, nHashType, pcache.get());
+}
+
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
@@ -1486,6 +2220,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         if (pvChecks)
             pvChecks->reserve(vin.size());
 
+        // Inputs signed with SIGHASH_ALL share the serialization of the rest
+        // of the transaction; prepare it once instead of once per input.
+        boost::shared_ptr<const CSignatureHashCache> pcache;
+        if (fScriptChecks && vin.size() > 1)
+            pcache.reset(new CSignatureHashCache(*this));
+
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
@@ -1508,7 +2248,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (fScriptChecks)
             {
                 // Verify signature
-                CScriptCheck check(txPrev, *this, i, flags, 0);
+                CScriptCheck check(txPrev, *this, i, flags, 0, pcache);
                 if (pvChecks)
                 {
                     pvChecks->push_back(CScriptCheck());
@@ -1519,7 +2259,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                     if (flags & STRICT_FLAGS)
                     {
                         // Don't trigger DoS code in case of STRICT_FLAGS caused failure.
-                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0);
+                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0, pcache);
                         if (check())
                             return error("ConnectInputs() : %s strict VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
                     }
@@ -1648,8 +2388,6 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck(void*) {
     vnThreadsRunning[THREAD_SCRIPTCHECK]++;
     RenameThread("novacoin-scriptch");
@@ -1661,7 +2399,177 @@ void ThreadScriptCheckQuit() {
     scriptcheckqueue.Quit();
 }
 
-bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
+/** Closure representing part of the context-free work on a block: hashing and
+ *  checking one transaction, or hashing a run of node pairs on one level of
+ *  the merkle tree. Every result goes to its own slot, so the outcome does not
+ *  depend on which worker happens to run what.
+ */
+class CBlockCheck
+{
+private:
+    const CTransaction *ptx;
+    std::vector<uint256> *pvTree;
+    unsigned char *pfOk;
+    unsigned int *pnSigOps;
+    unsigned int nLevel, nSize, nBegin, nEnd;
+
+public:
+    CBlockCheck() : ptx(NULL), pvTree(NULL), pfOk(NULL), pnSigOps(NULL), nLevel(0), nSize(0), nBegin(0), nEnd(0) {}
+
+    // Hash vtx[nTx] into the tree leaves and run the context-free checks on it
+    CBlockCheck(const CTransaction& txIn, unsigned int nTx, std::vector<uint256>& vTree, unsigned char& fOk, unsigned int& nSigOps) :
+        ptx(&txIn), pvTree(&vTree), pfOk(&fOk), pnSigOps(&nSigOps), nLevel(0), nSize(0), nBegin(nTx), nEnd(nTx + 1) {}
+
+    // Hash pairs [nBeginIn, nEndIn) of the tree level starting at nLevelIn
+    CBlockCheck(std::vector<uint256>& vTree, unsigned int nLevelIn, unsigned int nSizeIn, unsigned int nBeginIn, unsigned int nEndIn) :
+        ptx(NULL), pvTree(&vTree), pfOk(NULL), pnSigOps(NULL), nLevel(nLevelIn), nSize(nSizeIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        std::vector<uint256>& vTree = *pvTree;
+        if (ptx)
+        {
+            vTree[nBegin] = ptx->GetHash();
+            *pfOk = ptx->CheckTransaction() ? 1 : 0;
+            *pnSigOps = ptx->GetLegacySigOpCount();
+        }
+        else
+        {
+            for (unsigned int i = nBegin; i < nEnd; i++)
+            {
+                unsigned int i1 = nLevel + 2 * i;
+                unsigned int i2 = nLevel + std::min(2 * i + 1, nSize - 1);
+                vTree[nLevel + nSize + i] = Hash(BEGIN(vTree[i1]), END(vTree[i1]), BEGIN(vTree[i2]), END(vTree[i2]));
+            }
+        }
+
+        // Failures are reported through the slots, a false result would
+        // make the queue skip the remaining work
+        return true;
+    }
+
+    void swap(CBlockCheck &check)
+    {
+        std::swap(ptx, check.ptx);
+        std::swap(pvTree, check.pvTree);
+        std::swap(pfOk, check.pfOk);
+        std::swap(pnSigOps, check.pnSigOps);
+        std::swap(nLevel, check.nLevel);
+        std::swap(nSize, check.nSize);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
+// Blocks with fewer transactions are checked on the calling thread
+static const unsigned int BLOCK_CHECK_MIN_PARALLEL_TX = 16;
+// Number of merkle node pairs hashed by one queued check
+static const unsigned int MERKLE_PAIRS_PER_CHECK = 64;
+
+static CCheckQueue<CBlockCheck> blockcheckqueue(128);
+static CCriticalSection cs_blockcheckqueue;
+
+// Time spent on the transaction pre-pass of CheckBlock, serial and parallel
+static int64_t nBlockCheckTime[2] = { 0, 0 };
+static int64_t nBlockCheckTx[2] = { 0, 0 };
+
+void ThreadBlockCheck(void*) {
+    vnThreadsRunning[THREAD_BLOCKCHECK]++;
+    RenameThread("novacoin-blockch");
+    blockcheckqueue.Thread();
+    vnThreadsRunning[THREAD_BLOCKCHECK]--;
+}
+
+void ThreadBlockCheckQuit() {
+    blockcheckqueue.Quit();
+}
+
+// Hash the transactions of a block, run CheckTransaction() and count legacy
+// sigops for each of them and build the merkle tree. Large blocks are spread
+// over the block check threads; the results are identical either way.
+static uint256 CheckBlockTransactions(const CBlock& block, std::vector<unsigned char>& vTxOk, std::vector<unsigned int>& vTxSigOps)
+{
+    const std::vector<CTransaction>& vtx = block.vtx;
+    std::vector<uint256>& vMerkleTree = block.vMerkleTree;
+    int64_t nStart = GetTimeMicros();
+
+    vTxOk.assign(vtx.size(), 0);
+    vTxSigOps.assign(vtx.size(), 0);
+
+    bool fParallel = false;
+    if (nScriptCheckThreads && vtx.size() >= BLOCK_CHECK_MIN_PARALLEL_TX)
+    {
+        // The queue only takes one master at a time
+        TRY_LOCK(cs_blockcheckqueue, lockQueue);
+        if (lockQueue)
+        {
+            fParallel = true;
+
+            unsigned int nNodes = vtx.size();
+            for (unsigned int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+                nNodes += (nSize + 1) / 2;
+            vMerkleTree.assign(nNodes, 0);
+
+            {
+                CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+                std::vector<CBlockCheck> vChecks(vtx.size());
+                for (unsigned int i = 0; i < vtx.size(); i++)
+                    CBlockCheck(vtx[i], i, vMerkleTree, vTxOk[i], vTxSigOps[i]).swap(vChecks[i]);
+                control.Add(vChecks);
+                control.Wait();
+            }
+
+            // Levels depend on each other, only the pairs within a level
+            // are hashed concurrently
+            unsigned int nLevel = 0;
+            for (unsigned int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+            {
+                unsigned int nPairs = (nSize + 1) / 2;
+                if (nPairs < 2 * MERKLE_PAIRS_PER_CHECK)
+                    CBlockCheck(vMerkleTree, nLevel, nSize, 0, nPairs)();
+                else
+                {
+                    CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+                    std::vector<CBlockCheck> vChecks;
+                    for (unsigned int i = 0; i < nPairs; i += MERKLE_PAIRS_PER_CHECK)
+                    {
+                        vChecks.push_back(CBlockCheck());
+                        CBlockCheck(vMerkleTree, nLevel, nSize, i, std::min(i + MERKLE_PAIRS_PER_CHECK, nPairs)).swap(vChecks.back());
+                    }
+                    control.Add(vChecks);
+                    control.Wait();
+                }
+                nLevel += nSize;
+            }
+        }
+    }
+
+    if (!fParallel)
+    {
+        block.BuildMerkleTree();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            vTxOk[i] = vtx[i].CheckTransaction() ? 1 : 0;
+            vTxSigOps[i] = vtx[i].GetLegacySigOpCount();
+        }
+    }
+
+    int64_t nTime = GetTimeMicros() - nStart;
+    {
+        LOCK(cs_blockcheckqueue);
+        nBlockCheckTime[fParallel] += nTime;
+        nBlockCheckTx[fParallel] += vtx.size();
+        if (fDebug && vtx.size() >= BLOCK_CHECK_MIN_PARALLEL_TX)
+            printf("CheckBlockTransactions() : %" PRIszu " transactions in %.2fms %s (average %.2fus/tx serial, %.2fus/tx parallel)\n",
+                vtx.size(), nTime * 0.001, fParallel ? "parallel" : "serial",
+                nBlockCheckTx[0] ? (double)nBlockCheckTime[0] / nBlockCheckTx[0] : 0.0,
+                nBlockCheckTx[1] ? (double)nBlockCheckTime[1] / nBlockCheckTx[1] : 0.0);
+    }
+
+    return vMerkleTree.empty() ? 0 : vMerkleTree.back();
+}
+
+bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck, CCheckQueueControl<CScriptCheck>* pcontrol)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
@@ -1692,15 +2600,20 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads && !pcontrol ? &scriptcheckqueue : NULL);
+    if (!pcontrol)
+        pcontrol = &control;
 
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    for (unsigned int i = 0; i < vtx.size(); i++)
     {
-        uint256 hashTx = tx.GetHash();
+        CTransaction& tx = vtx[i];
+
+        // Merkle tree has just been rebuilt by CheckBlock() above
+        uint256 hashTx = GetTxHash(i);
 
         if (fEnforceBIP30) {
             CTxIndex txindexOld;
@@ -1753,13 +2666,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             std::vector<CScriptCheck> vChecks;
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fScriptChecks, nFlags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            pcontrol->Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
-    if (!control.Wait())
+    if (pcontrol == &control && !control.Wait())
         return DoS(100, false);
 
     if (IsProofOfWork())
@@ -1804,9 +2717,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
-    // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, true);
+    // Watch for transactions paying to me. With a caller supplied pcontrol the
+    // scripts are not verified yet, so the caller syncs once they are.
+    if (pcontrol == &control)
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            SyncWithWallets(tx, this, true);
 
 
     return true;
@@ -1819,15 +2734,26 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     // Find the fork
     CBlockIndex* pfork = pindexBest;
     CBlockIndex* plonger = pindexNew;
+    if (plonger->nHeight > pfork->nHeight)
+        plonger = plonger->GetAncestor(pfork->nHeight);
+    else
+        pfork = pfork->GetAncestor(plonger->nHeight);
     while (pfork != plonger)
     {
-        while (plonger->nHeight > pfork->nHeight)
-            if ((plonger = plonger->pprev) == NULL)
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if ((pfork = pfork->pprev) == NULL)
-            return error("Reorganize() : pfork->pprev is null");
+        if (pfork == NULL || plonger == NULL)
+            return error("Reorganize() : pprev is null");
+        // Blocks at the same height skip to the same height, so a differing
+        // pskip means the fork is further back than that
+        if (pfork->pskip && plonger->pskip && pfork->pskip != plonger->pskip)
+        {
+            pfork = pfork->pskip;
+            plonger = plonger->pskip;
+        }
+        else
+        {
+            pfork = pfork->pprev;
+            plonger = plonger->pprev;
+        }
     }
 
     // List of what to disconnect
@@ -1894,6 +2820,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetMainChainTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1909,6 +2836,73 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 }
 
 
+// Maximum number of blocks connected by one ConnectBlocksPipelined call
+static const unsigned int nMaxPipelinedBlocks = 16;
+
+// Connect a run of blocks extending the current best chain in a single db
+// transaction. Script checks of every block keep running on the script
+// checking threads while the inputs of the following blocks are fetched, and
+// are waited for only once, before the transaction is committed. If any block
+// turns out to be invalid nothing is committed; the caller is then expected
+// to connect the blocks one by one to find the offending one.
+bool static ConnectBlocksPipelined(CTxDB& txdb, const vector<CBlockIndex*>& vConnect)
+{
+    if (!txdb.TxnBegin())
+        return error("ConnectBlocksPipelined() : TxnBegin failed");
+
+    int64_t nStart = GetTimeMicros();
+
+    // Queued script checks refer to transactions of these blocks
+    list<CBlock> lBlocks;
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        {
+            lBlocks.push_back(CBlock());
+            CBlock& block = lBlocks.back();
+            if (!block.ReadFromDisk(pindex) || !block.ConnectBlock(txdb, pindex, false, &control))
+            {
+                control.Wait();
+                txdb.TxnAbort();
+                return false;
+            }
+        }
+        if (!control.Wait())
+        {
+            txdb.TxnAbort();
+            return false;
+        }
+    }
+
+    if (!txdb.WriteHashBestChain(vConnect.back()->GetBlockHash()))
+    {
+        txdb.TxnAbort();
+        return error("ConnectBlocksPipelined() : WriteHashBestChain failed");
+    }
+    if (!txdb.TxnCommit())
+        return error("ConnectBlocksPipelined() : TxnCommit failed");
+
+    // Add to current best branch
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        pindex->pprev->pnext = pindex;
+    SetMainChainTip(vConnect.back());
+
+    // Watch for transactions paying to me, now that the blocks are committed
+    BOOST_FOREACH(CBlock& block, lBlocks)
+        BOOST_FOREACH(CTransaction& tx, block.vtx)
+            SyncWithWallets(tx, &block, true);
+
+    // Delete redundant memory transactions
+    BOOST_FOREACH(CBlock& block, lBlocks)
+        BOOST_FOREACH(CTransaction& tx, block.vtx)
+            mempool.remove(tx);
+
+    if (fDebug)
+        printf("ConnectBlocksPipelined() : connected %" PRIszu " blocks in %.2fms\n", vConnect.size(), (GetTimeMicros() - nStart) * 0.001);
+
+    return true;
+}
+
 // Called from inside SetBestChain: attaches a block to the new best chain being built
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
@@ -1926,6 +2920,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    SetMainChainTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1947,6 +2942,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        SetMainChainTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1972,19 +2968,35 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!vpindexSecondary.empty())
             printf("Postponing %" PRIszu " reconnects\n", vpindexSecondary.size());
 
-        // Switch to new best branch
-        if (!Reorganize(txdb, pindexIntermediate))
+        if (pindexIntermediate->pprev == pindexBest)
+        {
+            // Nothing to disconnect, the whole branch just extends the current one
+            txdb.TxnAbort();
+            vpindexSecondary.push_back(pindexIntermediate);
+        }
+        else if (!Reorganize(txdb, pindexIntermediate))
         {
+            // Switch to new best branch
             txdb.TxnAbort();
             InvalidChainFound(pindexNew);
             return error("SetBestChain() : Reorganize failed");
         }
 
-        // Connect further blocks
-        for (std::vector<CBlockIndex*>::reverse_iterator rit = vpindexSecondary.rbegin(); rit != vpindexSecondary.rend(); ++rit)
+        // Connect further blocks, several at once if script checks run in parallel
+        std::reverse(vpindexSecondary.begin(), vpindexSecondary.end());
+        unsigned int nConnected = 0;
+        while (nScriptCheckThreads && vpindexSecondary.size() - nConnected > 1)
+        {
+            unsigned int nCount = std::min((unsigned int)vpindexSecondary.size() - nConnected, nMaxPipelinedBlocks);
+            vector<CBlockIndex*> vConnect(vpindexSecondary.begin() + nConnected, vpindexSecondary.begin() + nConnected + nCount);
+            if (!ConnectBlocksPipelined(txdb, vConnect))
+                break;
+            nConnected += nCount;
+        }
+        for (std::vector<CBlockIndex*>::iterator it = vpindexSecondary.begin() + nConnected; it != vpindexSecondary.end(); ++it)
         {
             CBlock block;
-            if (!block.ReadFromDisk(*rit))
+            if (!block.ReadFromDisk(*it))
             {
                 printf("SetBestChain() : ReadFromDisk failed\n");
                 break;
@@ -1994,9 +3006,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
                 break;
             }
             // errors now are not fatal, we still did a reorganisation to a new chain in a valid way
-            if (!block.SetBestChainInner(txdb, *rit))
+            if (!block.SetBestChainInner(txdb, *it))
                 break;
         }
+
+        if (pindexIntermediate->pprev && pindexIntermediate->pprev->pnext != pindexIntermediate)
+            return error("SetBestChain() : connecting %s failed", pindexIntermediate->GetBlockHash().ToString().substr(0,20).c_str());
     }
 
     // Update best block in wallet (so we can detect restored wallets)
@@ -2010,7 +3025,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2121,6 +3135,19 @@ bool CBlock::GetCoinAge(uint64_t& nCoinAge) const
     return true;
 }
 
+// Set while ProcessBlock accepts a run of orphans during initial download, so
+// they are connected together once all of them are in the index
+static bool fDeferBestChain = false;
+
+// Sets fDeferBestChain for its lifetime, so an exception thrown while the
+// orphans are accepted can't leave the tip stuck
+class CDeferBestChain
+{
+public:
+    explicit CDeferBestChain(bool fDefer) { fDeferBestChain = fDefer; }
+    ~CDeferBestChain() { fDeferBestChain = false; }
+};
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 {
     // Check for duplicate
@@ -2129,15 +3156,15 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = mapBlockIndex.NewIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
 
     // ppcoin: compute chain trust score
@@ -2166,7 +3193,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2180,7 +3207,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->nChainTrust > nBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust && !fDeferBestChain)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2215,15 +3242,21 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
 
     bool fProofOfStake = IsProofOfStake();
 
+    // Hash and check the transactions once, the tree is checked against the
+    // header below and keeps the hashes for ConnectBlock
+    vector<unsigned char> vTxOk;
+    vector<unsigned int> vTxSigOps;
+    uint256 hashMerkleRootTx = CheckBlockTransactions(*this, vTxOk, vTxSigOps);
+
     // First transaction must be coinbase, the rest must not be
     if (!vtx[0].IsCoinBase())
         return DoS(100, error("CheckBlock() : first tx is not coinbase"));
 
-    if (!vtx[0].CheckTransaction())
+    if (!vTxOk[0])
         return DoS(vtx[0].nDoS, error("CheckBlock() : CheckTransaction failed on coinbase"));
 
-    uniqueTx.insert(vtx[0].GetHash());
-    nSigOps += vtx[0].GetLegacySigOpCount();
+    uniqueTx.insert(vMerkleTree[0]);
+    nSigOps += vTxSigOps[0];
 
     if (fProofOfStake)
     {
@@ -2246,11 +3279,11 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         if (fCheckSig && !CheckBlockSignature())
             return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
 
-        if (!vtx[1].CheckTransaction())
+        if (!vTxOk[1])
             return DoS(vtx[1].nDoS, error("CheckBlock() : CheckTransaction failed on coinstake"));
 
-        uniqueTx.insert(vtx[1].GetHash());
-        nSigOps += vtx[1].GetLegacySigOpCount();
+        uniqueTx.insert(vMerkleTree[1]);
+        nSigOps += vTxSigOps[1];
     }
     else
     {
@@ -2286,14 +3319,14 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
             return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
 
         // Check transaction consistency
-        if (!tx.CheckTransaction())
+        if (!vTxOk[i])
             return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
 
         // Add transaction hash into list of unique transaction IDs
-        uniqueTx.insert(tx.GetHash());
+        uniqueTx.insert(vMerkleTree[i]);
 
         // Calculate sigops count
-        nSigOps += tx.GetLegacySigOpCount();
+        nSigOps += vTxSigOps[i];
     }
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
@@ -2306,7 +3339,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootTx)
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
@@ -2320,7 +3353,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2484,6 +3517,83 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+CBlockIndexMap::iterator CBlockIndexMap::find(const uint256& hash)
+{
+    if (nSize == 0)
+        return end();
+    for (size_t nBucket = Bucket(hash); vBuckets[nBucket] != 0; nBucket = (nBucket + 1) & (vBuckets.size() - 1))
+        if (Entry(vBuckets[nBucket] - 1).first == hash)
+            return iterator(this, vBuckets[nBucket] - 1);
+    return end();
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& value)
+{
+    // Keep the load factor below 3/4
+    if ((nSize + 1) * 4 > vBuckets.size() * 3)
+        Rehash(std::max(vBuckets.size() * 2, (size_t)nChunkSize));
+
+    size_t nBucket = Bucket(value.first);
+    for (; vBuckets[nBucket] != 0; nBucket = (nBucket + 1) & (vBuckets.size() - 1))
+        if (Entry(vBuckets[nBucket] - 1).first == value.first)
+            return make_pair(iterator(this, vBuckets[nBucket] - 1), false);
+
+    if (nSize % nChunkSize == 0 && nSize / nChunkSize == vEntryChunks.size())
+        vEntryChunks.push_back(static_cast<value_type*>(::operator new(nChunkSize * sizeof(value_type))));
+    new (&Entry(nSize)) value_type(value);
+    vBuckets[nBucket] = (uint32_t)++nSize;
+
+    return make_pair(iterator(this, nSize - 1), true);
+}
+
+void CBlockIndexMap::Rehash(size_t nBuckets)
+{
+    vBuckets.assign(nBuckets, 0);
+    for (size_t nPos = 0; nPos < nSize; nPos++)
+    {
+        size_t nBucket = Bucket(Entry(nPos).first);
+        while (vBuckets[nBucket] != 0)
+            nBucket = (nBucket + 1) & (vBuckets.size() - 1);
+        vBuckets[nBucket] = (uint32_t)(nPos + 1);
+    }
+}
+
+void CBlockIndexMap::reserve(size_t nEntries)
+{
+    size_t nBuckets = std::max(vBuckets.size(), (size_t)nChunkSize);
+    while (nEntries * 4 > nBuckets * 3)
+        nBuckets *= 2;
+    if (nBuckets != vBuckets.size())
+        Rehash(nBuckets);
+    while (vEntryChunks.size() * nChunkSize < nEntries)
+        vEntryChunks.push_back(static_cast<value_type*>(::operator new(nChunkSize * sizeof(value_type))));
+}
+
+CBlockIndex* CBlockIndexMap::NewIndex()
+{
+    if (nIndexes % nChunkSize == 0)
+        vIndexChunks.push_back(static_cast<CBlockIndex*>(::operator new(nChunkSize * sizeof(CBlockIndex))));
+    CBlockIndex* pindex = &vIndexChunks[nIndexes / nChunkSize][nIndexes % nChunkSize];
+    nIndexes++;
+    return new (pindex) CBlockIndex();
+}
+
+void CBlockIndexMap::clear()
+{
+    for (size_t nPos = 0; nPos < nSize; nPos++)
+        Entry(nPos).~value_type();
+    for (size_t nPos = 0; nPos < nIndexes; nPos++)
+        vIndexChunks[nPos / nChunkSize][nPos % nChunkSize].~CBlockIndex();
+    BOOST_FOREACH(value_type* pchunk, vEntryChunks)
+        ::operator delete(pchunk);
+    BOOST_FOREACH(CBlockIndex* pchunk, vIndexChunks)
+        ::operator delete(pchunk);
+    vEntryChunks.clear();
+    vIndexChunks.clear();
+    vBuckets.clear();
+    nSize = nIndexes = 0;
+}
+
 bool static ReserealizeBlockSignature(CBlock* pblock)
 {
     if (pblock->IsProofOfWork())
@@ -2503,7 +3613,7 @@ bool static IsCanonicalBlockSignature(CBlock* pblock)
     return IsDERSignature(pblock->vchBlockSig);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2532,7 +3642,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     }
 
     // Preliminary checks
-    if (!pblock->CheckBlock(true, true, (pblock->nTime > Checkpoints::GetLastCheckpointTime())))
+    if (!fCheckedBlock && !pblock->CheckBlock(true, true, (pblock->nTime > Checkpoints::GetLastCheckpointTime())))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // ppcoin: verify hash target and signature of coinstake tx
@@ -2589,11 +3699,11 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
         }
         CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        AddOrphanBlock(hash, pblock2);
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless the block is
+        // being fetched as part of the header chain anyway
+        if (pfrom && !mapHeaderChain.count(hash))
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ppcoin: getblocks may not obtain the ancestor block rejected
@@ -2601,6 +3711,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (!IsInitialBlockDownload())
                 pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
         }
+        LimitOrphanBlocks();
         return true;
     }
 
@@ -2608,24 +3719,47 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
-    vector<uint256> vWorkQueue;
-    vWorkQueue.push_back(hash);
-    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    // Recursively process any orphan blocks that depended on this one.
+    // During initial download they are connected as one run afterwards, which
+    // lets the script checks of consecutive blocks overlap.
+    CBlockIndex* pindexDeferred = NULL;
     {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        CDeferBestChain deferBestChain(nScriptCheckThreads && IsInitialBlockDownload() && mapOrphanBlocksByPrev.count(hash));
+        vector<uint256> vWorkQueue;
+        vWorkQueue.push_back(hash);
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
-            delete pblockOrphan;
+            uint256 hashPrev = vWorkQueue[i];
+            for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+                 mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
+                 ++mi)
+            {
+                CBlock* pblockOrphan = (*mi).second;
+                uint256 hashOrphan = pblockOrphan->GetHash();
+                if (ReadOrphanBlock(hashOrphan, pblockOrphan) && pblockOrphan->AcceptBlock())
+                {
+                    vWorkQueue.push_back(hashOrphan);
+                    CBlockIndex* pindexOrphan = mapBlockIndex[hashOrphan];
+                    if (fDeferBestChain && pindexOrphan->nChainTrust > nBestChainTrust &&
+                        (!pindexDeferred || pindexOrphan->nChainTrust > pindexDeferred->nChainTrust))
+                        pindexDeferred = pindexOrphan;
+                }
+                mapOrphanBlocks.erase(hashOrphan);
+                ForgetOrphanBlock(hashOrphan);
+                delete pblockOrphan;
+            }
+            mapOrphanBlocksByPrev.erase(hashPrev);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
+    }
+
+    if (pindexDeferred)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindexDeferred))
+            return error("ProcessBlock() : ReadFromDisk failed");
+        CTxDB txdb;
+        if (!block.SetBestChain(txdb, pindexDeferred))
+            return error("ProcessBlock() : SetBestChain failed");
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -2684,11 +3818,64 @@ static filesystem::path BlockFilePath(unsigned int nFile)
     return GetDataDir() / strBlockFn;
 }
 
+static filesystem::path PrunedBlockFilePath(unsigned int nFile)
+{
+    string strPrunedFn = strprintf("blk%04u.prn", nFile);
+    return GetDataDir() / strPrunedFn;
+}
+
+// Idle read handles on block files, by file number. Block files are only
+// ever appended to, until pruning replaces one by its compacted version;
+// handles on the old file are dropped then and never mixed with the new one.
+static CCriticalSection cs_BlockFilePool;
+static map<unsigned int, vector<FILE*> > mapBlockFilePool;
+static unsigned int nBlockFilePoolSize = 0;
+static const unsigned int MAX_BLOCKFILE_POOL_SIZE = 16;
+
+// Kept ranges of the pruned block files, by file number. Guarded by
+// cs_BlockFilePool; an entry never changes once it is there.
+static map<unsigned int, vector<CPrunedRange> > mapPrunedFiles;
+
+static bool IsBlockFilePruned(unsigned int nFile)
+{
+    LOCK(cs_BlockFilePool);
+    return mapPrunedFiles.count(nFile) > 0;
+}
+
+// Translate a position in a block file to the file on disk. Fails if the
+// position is in data that was pruned.
+bool MapBlockFilePos(unsigned int nFile, unsigned int& nPos)
+{
+    LOCK(cs_BlockFilePool);
+    map<unsigned int, vector<CPrunedRange> >::const_iterator mi = mapPrunedFiles.find(nFile);
+    if (mi == mapPrunedFiles.end())
+        return true;
+
+    // Last range starting at or before nPos
+    const vector<CPrunedRange>& vRanges = mi->second;
+    unsigned int nLow = 0, nHigh = vRanges.size();
+    while (nLow < nHigh)
+    {
+        unsigned int nMid = (nLow + nHigh) / 2;
+        if (vRanges[nMid].nBegin <= nPos)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+    if (nLow == 0 || nPos >= vRanges[nLow - 1].nEnd)
+        return false;
+    nPos = vRanges[nLow - 1].nPrunedPos + (nPos - vRanges[nLow - 1].nBegin);
+    return true;
+}
+
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == std::numeric_limits<uint32_t>::max()))
         return NULL;
-    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
+    bool fPruned = IsBlockFilePruned(nFile);
+    if (fPruned && nBlockPos != 0 && !MapBlockFilePos(nFile, nBlockPos))
+        return NULL;
+    FILE* file = fopen((fPruned ? PrunedBlockFilePath(nFile) : BlockFilePath(nFile)).string().c_str(), pszMode);
     if (!file)
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
@@ -2702,85 +3889,1081 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+FILE* BorrowBlockFile(unsigned int nFile, bool& fPrunedRet)
+{
+    {
+        LOCK(cs_BlockFilePool);
+        fPrunedRet = mapPrunedFiles.count(nFile) > 0;
+        map<unsigned int, vector<FILE*> >::iterator mi = mapBlockFilePool.find(nFile);
+        if (mi != mapBlockFilePool.end() && !mi->second.empty())
+        {
+            FILE* file = mi->second.back();
+            mi->second.pop_back();
+            nBlockFilePoolSize--;
+            return file;
+        }
+    }
+    if ((nFile < 1) || (nFile == std::numeric_limits<uint32_t>::max()))
+        return NULL;
+    return fopen((fPrunedRet ? PrunedBlockFilePath(nFile) : BlockFilePath(nFile)).string().c_str(), "rb");
+}
+
+void ReturnBlockFile(unsigned int nFile, FILE* file, bool fPruned)
+{
+    {
+        LOCK(cs_BlockFilePool);
+        if (nBlockFilePoolSize < MAX_BLOCKFILE_POOL_SIZE && fPruned == (mapPrunedFiles.count(nFile) > 0))
+        {
+            mapBlockFilePool[nFile].push_back(file);
+            nBlockFilePoolSize++;
+            return;
+        }
+    }
+    fclose(file);
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
+// The block file being appended to stays open between blocks. Data is
+// handed to the OS right away, but the expensive commit to disk is left to
+// ThreadFlushBlockFiles, which groups it by time and size, and to
+// FlushBlockFiles(), which the block database calls before anything it
+// writes can become durable. That way the index never refers to block data
+// that could still be lost.
+static CCriticalSection cs_BlockFileWriter;
+static FILE* fileBlockAppend = NULL;
+static unsigned int nBlockAppendFile = 0;
+static unsigned int nBlockFileAllocated = 0;
+static uint64_t nBlockFileUnsynced = 0;
+static int64_t nBlockFileUnsyncedSince = 0;
+
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB preallocated at a time
+static const uint64_t BLOCKFILE_SYNC_BYTES = 0x2000000; // commit once this much is pending
+static const int64_t BLOCKFILE_SYNC_INTERVAL = 5; // or once the oldest pending data is this old
+
+static bool CommitBlockFile()
+{
+    if (fileBlockAppend && nBlockFileUnsynced > 0)
+    {
+        int64_t nStart = GetTimeMillis();
+        if (fflush(fileBlockAppend) != 0)
+            return error("CommitBlockFile() : fflush failed");
+        FileCommit(fileBlockAppend);
+        if (fDebug)
+            printf("CommitBlockFile() : committed %" PRIu64 " bytes of blk%04u.dat in %" PRId64 "ms\n", nBlockFileUnsynced, nBlockAppendFile, GetTimeMillis() - nStart);
+    }
+    nBlockFileUnsynced = 0;
+    return true;
+}
+
+// Pruning works on whole files, so they are kept small enough for several
+// of them to fit in the budget
+static unsigned int GetMaxBlockFileSize()
+{
+    if (fPruneMode)
+        return (unsigned int)std::min(nPruneTarget / 4, (uint64_t)0x7F000000);
+    return 0x7F000000;
+}
+
+// Return the open handle on the block file to append to, moving on to the
+// next file when the current one is full. The handle is owned here.
+static FILE* AppendBlockFile(unsigned int& nFileRet)
 {
     nFileRet = 0;
     for ( ; ; )
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
+        if (!fileBlockAppend || nBlockAppendFile != nCurrentBlockFile)
+        {
+            // Never append to what is left of a pruned file
+            while (IsBlockFilePruned(nCurrentBlockFile))
+                nCurrentBlockFile++;
+            fileBlockAppend = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+            if (!fileBlockAppend)
+                return NULL;
+            nBlockAppendFile = nCurrentBlockFile;
+            nBlockFileAllocated = 0;
+        }
+        if (fseek(fileBlockAppend, 0, SEEK_END) != 0)
             return NULL;
         // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        if (ftell(fileBlockAppend) < (long)(GetMaxBlockFileSize() - MAX_SIZE))
         {
             nFileRet = nCurrentBlockFile;
-            return file;
+            return fileBlockAppend;
         }
-        fclose(file);
+        // The full file is committed before we leave it behind
+        if (!CommitBlockFile())
+            return NULL;
+        fclose(fileBlockAppend);
+        fileBlockAppend = NULL;
         nCurrentBlockFile++;
     }
 }
 
-void UnloadBlockIndex()
+//
+// Block compression. With -compressblocks, a block is stored as its header,
+// the size of the whole block and the rest of it deflated, flagged by
+// BLOCKFILE_COMPRESSED in the size in front of it. The header stays where
+// it was so header reads don't change, and positions of transactions keep
+// their offset from the start of the block, as the stake kernel needs. A
+// transaction is read by inflating the block that holds it.
+//
+static CCriticalSection cs_BlockCompressionStats;
+static uint64_t nCompressedBlocks = 0;
+static uint64_t nCompressedRawBytes = 0;
+static uint64_t nCompressedStoredBytes = 0;
+static uint64_t nCompressedReads = 0;
+static int64_t nCompressedReadMicros = 0;
+
+static unsigned int GetBlockHeaderSize()
 {
-    mapBlockIndex.clear();
-    setStakeSeen.clear();
-    pindexGenesisBlock = NULL;
-    nBestHeight = 0;
-    nBestChainTrust = 0;
-    nBestInvalidTrust = 0;
-    hashBestChain = 0;
-    pindexBest = NULL;
+    static const unsigned int nHeaderSize = ::GetSerializeSize(CBlock(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+    return nHeaderSize;
 }
 
-bool LoadBlockIndex(bool fAllowNew)
+bool CompressBlockData(const char* pbegin, const char* pend, vector<unsigned char>& vchRet)
 {
-    if (fTestNet)
-    {
-        pchMessageStart[0] = 0xcd;
-        pchMessageStart[1] = 0xf2;
-        pchMessageStart[2] = 0xc0;
-        pchMessageStart[3] = 0xef;
-
-        bnProofOfWorkLimit = bnProofOfWorkLimitTestNet; // 16 bits PoW target limit for testnet
-        nStakeMinAge = 2 * nOneHour; // test net min age is 2 hours
-        nModifierInterval = 20 * 60; // test modifier interval is 20 minutes
-        nCoinbaseMaturity = 10; // test maturity is 10 blocks
-        nStakeTargetSpacing = 5 * 60; // test block spacing is 5 minutes
-    }
-
-    //
-    // Load block index
-    //
-    CTxDB txdb("cr+");
-    if (!txdb.LoadBlockIndex())
+    uLongf nCompressedSize = compressBound(pend - pbegin);
+    vchRet.resize(nCompressedSize);
+    if (compress2(&vchRet[0], &nCompressedSize, (const Bytef*)pbegin, pend - pbegin, Z_DEFAULT_COMPRESSION) != Z_OK)
         return false;
+    vchRet.resize(nCompressedSize);
+    return true;
+}
 
-    //
-    // Init with genesis block
-    //
-    if (mapBlockIndex.empty())
-    {
-        if (!fAllowNew)
-            return false;
+bool DecompressBlockData(const unsigned char* pbegin, const unsigned char* pend, char* pdest, unsigned int nDestSize)
+{
+    uLongf nSize = nDestSize;
+    return uncompress((Bytef*)pdest, &nSize, pbegin, pend - pbegin) == Z_OK && nSize == nDestSize;
+}
 
-        // Genesis block
+// Rebuild the block from a compressed record, without the size in front
+static bool InflateBlockRecord(const vector<unsigned char>& vch, CDataStream& ssRet)
+{
+    const unsigned int nHeaderSize = GetBlockHeaderSize();
+    if (vch.size() <= nHeaderSize + sizeof(unsigned int))
+        return error("InflateBlockRecord() : bad size %" PRIszu, vch.size());
+
+    unsigned int nRawSize = vch[nHeaderSize] | (vch[nHeaderSize + 1] << 8) | (vch[nHeaderSize + 2] << 16) | (vch[nHeaderSize + 3] << 24);
+    if (nRawSize <= nHeaderSize || nRawSize > MAX_SIZE)
+        return error("InflateBlockRecord() : bad block size %u", nRawSize);
+
+    ssRet.resize(nRawSize);
+    memcpy(&ssRet[0], &vch[0], nHeaderSize);
+    if (!DecompressBlockData(&vch[nHeaderSize + sizeof(nRawSize)], &vch[0] + vch.size(), &ssRet[nHeaderSize], nRawSize - nHeaderSize))
+        return error("InflateBlockRecord() : inflate failed");
+    return true;
+}
 
-        // MainNet:
+bool ReadCompressedBlock(CBlockFileReader& filein, unsigned int nSize, CDataStream& ssRet)
+{
+    int64_t nStart = GetTimeMicros();
 
-        //CBlock(hash=00000a060336cbb72fe969666d337b87198b1add2abaa59cca226820b32933a4, ver=1, hashPrevBlock=0000000000000000000000000000000000000000000000000000000000000000, hashMerkleRoot=4cb33b3b6a861dcbc685d3e614a9cafb945738d6833f182855679f2fad02057b, nTime=1360105017, nBits=1e0fffff, nNonce=1575379, vtx=1, vchBlockSig=)
-        //  Coinbase(hash=4cb33b3b6a, nTime=1360105017, ver=1, vin.size=1, vout.size=1, nLockTime=0)
-        //    CTxIn(COutPoint(0000000000, 4294967295), coinbase 04ffff001d020f274468747470733a2f2f626974636f696e74616c6b2e6f72672f696e6465782e7068703f746f7069633d3133343137392e6d736731353032313936236d736731353032313936)
-        //    CTxOut(empty)
-        //  vMerkleTree: 4cb33b3b6a
+    nSize &= ~BLOCKFILE_COMPRESSED;
+    if (nSize > MAX_SIZE)
+        return error("ReadCompressedBlock() : bad size %u", nSize);
 
-        // TestNet:
+    vector<unsigned char> vch(nSize);
+    if (nSize > 0)
+        filein.read((char*)&vch[0], nSize);
+    if (!InflateBlockRecord(vch, ssRet))
+        return false;
 
-        //CBlock(hash=0000c763e402f2436da9ed36c7286f62c3f6e5dbafce9ff289bd43d7459327eb, ver=1, hashPrevBlock=0000000000000000000000000000000000000000000000000000000000000000, hashMerkleRoot=4cb33b3b6a861dcbc685d3e614a9cafb945738d6833f182855679f2fad02057b, nTime=1360105017, nBits=1f00ffff, nNonce=46534, vtx=1, vchBlockSig=)
+    LOCK(cs_BlockCompressionStats);
+    nCompressedReads++;
+    nCompressedReadMicros += GetTimeMicros() - nStart;
+    return true;
+}
+
+// Replace the block record in ss, as built by WriteToDisk, by its compressed
+// form if that is smaller
+static void CompressBlockRecord(CDataStream& ss)
+{
+    const unsigned int nHeaderSize = GetBlockHeaderSize();
+    const unsigned int nPrefixSize = sizeof(pchMessageStart) + sizeof(unsigned int);
+    unsigned int nRawSize = ss.size() - nPrefixSize;
+
+    vector<unsigned char> vchCompressed;
+    if (!CompressBlockData(&ss[nPrefixSize + nHeaderSize], &ss[0] + ss.size(), vchCompressed))
+        return;
+    unsigned int nSize = nHeaderSize + sizeof(nRawSize) + vchCompressed.size();
+    if (nSize >= nRawSize)
+        return;
+
+    CDataStream ssCompressed(SER_DISK, CLIENT_VERSION);
+    ssCompressed.reserve(nPrefixSize + nSize);
+    ssCompressed << FLATDATA(pchMessageStart) << (nSize | BLOCKFILE_COMPRESSED);
+    ssCompressed.write(&ss[nPrefixSize], nHeaderSize);
+    ssCompressed << nRawSize;
+    ssCompressed.write((const char*)&vchCompressed[0], vchCompressed.size());
+    ss = ssCompressed;
+
+    LOCK(cs_BlockCompressionStats);
+    nCompressedBlocks++;
+    nCompressedRawBytes += nRawSize;
+    nCompressedStoredBytes += nSize;
+}
+
+void GetBlockCompressionStats(uint64_t& nBlocks, uint64_t& nRawBytes, uint64_t& nStoredBytes, uint64_t& nReads, int64_t& nReadMicros)
+{
+    LOCK(cs_BlockCompressionStats);
+    nBlocks = nCompressedBlocks;
+    nRawBytes = nCompressedRawBytes;
+    nStoredBytes = nCompressedStoredBytes;
+    nReads = nCompressedReads;
+    nReadMicros = nCompressedReadMicros;
+}
+
+bool CBlock::WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    // Index header and block, written out in one go
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+    ss.reserve(nSize + sizeof(pchMessageStart) + sizeof(nSize));
+    ss << FLATDATA(pchMessageStart) << nSize << *this;
+    if (fCompressBlocks)
+        CompressBlockRecord(ss);
+
+    LOCK(cs_BlockFileWriter);
+
+    // Open history file to append
+    FILE* fileout = AppendBlockFile(nFileRet);
+    if (!fileout)
+        return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+
+    long fileOutPos = ftell(fileout);
+    if (fileOutPos < 0)
+        return error("CBlock::WriteToDisk() : ftell failed");
+    nBlockPosRet = fileOutPos + sizeof(pchMessageStart) + sizeof(nSize);
+
+    // Reserve disk space ahead of the data in large chunks, so committing
+    // does not have to allocate blocks for every write
+    unsigned int nEnd = fileOutPos + ss.size();
+    if (nEnd > nBlockFileAllocated)
+    {
+        unsigned int nChunkEnd = (nEnd / BLOCKFILE_CHUNK_SIZE + 1) * BLOCKFILE_CHUNK_SIZE;
+        AllocateFileRange(fileout, fileOutPos, nChunkEnd - fileOutPos);
+        nBlockFileAllocated = nChunkEnd;
+    }
+
+    if (fwrite(&ss[0], 1, ss.size(), fileout) != ss.size() || fflush(fileout) != 0)
+        return error("CBlock::WriteToDisk() : write failed");
+
+    if (nBlockFileUnsynced == 0)
+        nBlockFileUnsyncedSince = GetTime();
+    nBlockFileUnsynced += ss.size();
+
+    return true;
+}
+
+bool FlushBlockFiles()
+{
+    LOCK(cs_BlockFileWriter);
+    return CommitBlockFile();
+}
+
+void ThreadFlushBlockFiles(void* parg)
+{
+    // Make this thread recognisable as the block file flushing thread
+    RenameThread("novacoin-blkflush");
+
+    while (!fShutdown)
+    {
+        Sleep(250);
+
+        LOCK(cs_BlockFileWriter);
+        if (nBlockFileUnsynced >= BLOCKFILE_SYNC_BYTES ||
+            (nBlockFileUnsynced > 0 && GetTime() - nBlockFileUnsyncedSince >= BLOCKFILE_SYNC_INTERVAL))
+            CommitBlockFile();
+    }
+}
+
+void CloseBlockFiles()
+{
+    {
+        LOCK(cs_BlockFileWriter);
+        CommitBlockFile();
+        if (fileBlockAppend)
+            fclose(fileBlockAppend);
+        fileBlockAppend = NULL;
+    }
+
+    LOCK(cs_BlockFilePool);
+    for (map<unsigned int, vector<FILE*> >::iterator mi = mapBlockFilePool.begin(); mi != mapBlockFilePool.end(); ++mi)
+        BOOST_FOREACH(FILE* file, mi->second)
+            fclose(file);
+    mapBlockFilePool.clear();
+    nBlockFilePoolSize = 0;
+}
+
+//
+// Block file pruning. Files are pruned oldest first, once every block in them
+// is too deep to be disconnected. What is still needed of a file is copied
+// into blkNNNN.prn: the transactions with outputs that are unspent or spent
+// by blocks that could still be disconnected, and the headers of their
+// blocks, which the stake kernel and coin age read. Size fields are kept with
+// the headers, and compressed blocks are kept whole. The original file is then
+// deleted. Positions in it stay valid through the kept ranges, so the
+// transaction index is left as it is and the blocks are only marked pruned.
+// This runs in ThreadPruneBlockFiles; cs_main is only held to look at the
+// block index and to commit the result.
+//
+static uint64_t nPrunedFileBytes = 0;
+static int nPruneCheckHeight = 0;
+
+// Kept ranges closer than this are copied as one
+static const unsigned int PRUNE_MERGE_GAP = 16;
+// Blocks to wait before looking at the budget again
+static const int PRUNE_CHECK_INTERVAL = 10;
+
+static uint64_t GetBlockFileSize(const filesystem::path& path)
+{
+    boost::system::error_code ec;
+    uint64_t nSize = filesystem::file_size(path, ec);
+    return ec ? 0 : nSize;
+}
+
+static void AddPrunedFile(unsigned int nFile, const vector<CPrunedRange>& vRanges)
+{
+    {
+        LOCK(cs_BlockFilePool);
+        mapPrunedFiles[nFile] = vRanges;
+        map<unsigned int, vector<FILE*> >::iterator mi = mapBlockFilePool.find(nFile);
+        if (mi != mapBlockFilePool.end())
+        {
+            BOOST_FOREACH(FILE* file, mi->second)
+                fclose(file);
+            nBlockFilePoolSize -= mi->second.size();
+            mapBlockFilePool.erase(mi);
+        }
+    }
+    nPrunedFileBytes += GetBlockFileSize(PrunedBlockFilePath(nFile));
+
+    // Readers still holding a handle on the original keep reading it. If it
+    // can't be removed now, that is tried again on the next start.
+    boost::system::error_code ec;
+    filesystem::remove(BlockFilePath(nFile), ec);
+}
+
+static bool LoadPrunedBlockFiles(CTxDB& txdb)
+{
+    vector<CPrunedRange> vRanges;
+    unsigned int nFile = 1;
+    for ( ; txdb.ReadPrunedFile(nFile, vRanges); nFile++)
+    {
+        if (!filesystem::exists(PrunedBlockFilePath(nFile)))
+            return error("LoadPrunedBlockFiles() : blk%04u.prn is missing", nFile);
+        AddPrunedFile(nFile, vRanges);
+    }
+
+    if (nFile > 1)
+    {
+        // Old blocks can't be served any more
+        nLocalServices &= ~NODE_NETWORK;
+        printf("LoadPrunedBlockFiles() : %u block files pruned, %" PRIu64 " bytes kept\n", nFile - 1, nPrunedFileBytes);
+    }
+    return true;
+}
+
+// Whether a transaction has to be kept when its block file is pruned
+static bool IsPrunedTxNeeded(const CTransaction& tx, const CTxIndex& txindex, int nPruneHeight,
+    const vector<int>& vFileMaxHeight, const map<pair<unsigned int, unsigned int>, int>& mapBlockHeight)
+{
+    for (unsigned int i = 0; i < tx.vout.size() && i < txindex.vSpent.size(); i++)
+    {
+        const CDiskTxPos& posSpent = txindex.vSpent[i];
+        if (posSpent.IsNull())
+        {
+            // Unspent, unless it can never be spent
+            const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+            if (scriptPubKey.empty() || scriptPubKey[0] != OP_RETURN)
+                return true;
+            continue;
+        }
+
+        // Spent by a block that could still be disconnected
+        if (posSpent.nFile < vFileMaxHeight.size() && vFileMaxHeight[posSpent.nFile] <= nPruneHeight)
+            continue;
+        map<pair<unsigned int, unsigned int>, int>::const_iterator mi = mapBlockHeight.find(make_pair(posSpent.nFile, posSpent.nBlockPos));
+        if (mi == mapBlockHeight.end() || mi->second > nPruneHeight)
+            return true;
+    }
+    return false;
+}
+
+// Copy what is needed of a block file without holding cs_main. The blocks
+// in it are too deep to change, and so is whether their transactions are
+// needed, so only the commit has to take the lock.
+static bool PruneBlockFile(unsigned int nFile, const vector<CBlockIndex*>& vBlocks, int nPruneHeight,
+    const vector<int>& vFileMaxHeight, const map<pair<unsigned int, unsigned int>, int>& mapBlockHeight)
+{
+    int64_t nStart = GetTimeMillis();
+    const unsigned int nHeaderSize = GetBlockHeaderSize();
+
+    // Find the ranges to keep
+    CTxDB txdbRead("r");
+    vector<pair<unsigned int, unsigned int> > vKeep;
+    unsigned int nTx = 0, nKeptTx = 0;
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(nFile, pindex->nBlockPos))
+            return error("PruneBlockFile() : ReadFromDisk failed for block %s", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+
+        // Size in front of the block, readers look at it first
+        unsigned int nSize = 0;
+        {
+            CBlockFileReader filein(nFile, pindex->nBlockPos - sizeof(nSize), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("PruneBlockFile() : OpenBlockFile failed");
+            try {
+                filein >> nSize;
+            }
+            catch (const std::exception&) {
+                return error("%s() : deserialize or I/O error", BOOST_CURRENT_FUNCTION);
+            }
+        }
+
+        bool fKeepHeader = false;
+        unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            // Only the copy the transaction index points at is ever read
+            CTxIndex txindex;
+            if (txdbRead.ReadTxIndex(tx.GetHash(), txindex) && txindex.pos == CDiskTxPos(nFile, pindex->nBlockPos, nTxPos) &&
+                IsPrunedTxNeeded(tx, txindex, nPruneHeight, vFileMaxHeight, mapBlockHeight))
+            {
+                if (!(nSize & BLOCKFILE_COMPRESSED))
+                    vKeep.push_back(make_pair(nTxPos, nTxPos + nTxSize));
+                fKeepHeader = true;
+                nKeptTx++;
+            }
+            nTxPos += nTxSize;
+            nTx++;
+        }
+        if (!fKeepHeader)
+            continue;
+        // A compressed block is kept whole, transactions are read by inflating it
+        if (nSize & BLOCKFILE_COMPRESSED)
+            vKeep.push_back(make_pair(pindex->nBlockPos - sizeof(nSize), pindex->nBlockPos + (nSize & ~BLOCKFILE_COMPRESSED)));
+        else
+            vKeep.push_back(make_pair(pindex->nBlockPos - sizeof(nSize), pindex->nBlockPos + nHeaderSize));
+        if (fShutdown)
+            return false;
+    }
+    sort(vKeep.begin(), vKeep.end());
+
+    // Copy them into the compacted file
+    filesystem::path pathTmp = GetDataDir() / strprintf("blk%04u.prn.tmp", nFile);
+    FILE* filein = fopen(BlockFilePath(nFile).string().c_str(), "rb");
+    FILE* fileout = fopen(pathTmp.string().c_str(), "wb");
+    bool fOk = (filein != NULL && fileout != NULL);
+    vector<CPrunedRange> vRanges;
+    vector<char> vch;
+    unsigned int nPrunedPos = 0;
+    for (unsigned int i = 0; fOk && i < vKeep.size(); )
+    {
+        unsigned int nBegin = vKeep[i].first, nEnd = vKeep[i].second;
+        for (i++; i < vKeep.size() && vKeep[i].first <= nEnd + PRUNE_MERGE_GAP; i++)
+            nEnd = std::max(nEnd, vKeep[i].second);
+
+        vch.resize(nEnd - nBegin);
+        fOk = (fseek(filein, nBegin, SEEK_SET) == 0 &&
+               fread(&vch[0], 1, vch.size(), filein) == vch.size() &&
+               fwrite(&vch[0], 1, vch.size(), fileout) == vch.size());
+        vRanges.push_back(CPrunedRange(nBegin, nEnd, nPrunedPos));
+        nPrunedPos += vch.size();
+    }
+    if (filein)
+        fclose(filein);
+    if (fileout)
+    {
+        fOk = fOk && fflush(fileout) == 0;
+        if (fOk)
+            FileCommit(fileout);
+        fclose(fileout);
+    }
+    if (!fOk || !RenameOver(pathTmp, PrunedBlockFilePath(nFile)))
+        return error("PruneBlockFile() : writing blk%04u.prn failed", nFile);
+
+    // The index has to know about the compacted file before the original goes
+    LOCK(cs_main);
+    if (fShutdown)
+        return false;
+    CTxDB txdb;
+    if (!txdb.TxnBegin())
+        return error("PruneBlockFile() : TxnBegin failed");
+    txdb.WritePrunedFile(nFile, vRanges);
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        CDiskBlockIndex diskindex(pindex);
+        diskindex.nFlags |= CBlockIndex::BLOCK_PRUNED;
+        txdb.WriteBlockIndex(diskindex);
+    }
+    if (!txdb.TxnCommit())
+        return error("PruneBlockFile() : TxnCommit failed");
+#ifdef USE_LEVELDB
+    if (!txdb.Flush())
+        return error("PruneBlockFile() : Flush failed");
+#endif
+
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+        pindex->SetPruned();
+    uint64_t nFileSize = GetBlockFileSize(BlockFilePath(nFile));
+    AddPrunedFile(nFile, vRanges);
+
+    printf("PruneBlockFile() : pruned blk%04u.dat, kept %u of %u transactions, %u of %" PRIu64 " bytes in %" PRId64 "ms\n",
+        nFile, nKeptTx, nTx, nPrunedPos, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Prune the oldest block file if block files take more than the -prune
+// budget and all blocks in it are deep enough. A file is pruned at a time.
+static bool PruneBlockFiles()
+{
+    {
+        LOCK(cs_main);
+        if (nBestHeight < nPruneCheckHeight)
+            return true;
+        nPruneCheckHeight = nBestHeight + PRUNE_CHECK_INTERVAL;
+    }
+
+    unsigned int nFirstFile, nLastFile;
+    {
+        LOCK(cs_BlockFilePool);
+        nFirstFile = mapPrunedFiles.size() + 1;
+    }
+    {
+        LOCK(cs_BlockFileWriter);
+        nLastFile = nCurrentBlockFile;
+    }
+    // The file being appended to stays
+    if (nFirstFile >= nLastFile)
+        return true;
+
+    uint64_t nBytes = nPrunedFileBytes;
+    for (unsigned int nFile = nFirstFile; nFile <= nLastFile; nFile++)
+        nBytes += GetBlockFileSize(BlockFilePath(nFile));
+    if (nBytes <= nPruneTarget)
+        return true;
+
+    // Take a copy of the block positions in one pass over the index, the
+    // rest is worked out without the lock
+    int nPruneHeight;
+    vector<CBlockIndex*> vBlocks;
+    vector<pair<pair<unsigned int, unsigned int>, int> > vBlockPos;
+    {
+        LOCK(cs_main);
+
+        // Nothing at or below this height can be disconnected any more
+        nPruneHeight = nBestHeight - MIN_BLOCKS_TO_KEEP;
+        CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+        if (pcheckpoint && pcheckpoint->nHeight < nPruneHeight)
+            nPruneHeight = pcheckpoint->nHeight;
+
+        vBlockPos.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            if (pindex->nFile > nLastFile)
+                continue;
+            vBlockPos.push_back(make_pair(make_pair(pindex->nFile, pindex->nBlockPos), pindex->nHeight));
+            if (pindex->nFile == nFirstFile)
+                vBlocks.push_back(pindex);
+        }
+    }
+
+    vector<int> vFileMaxHeight(nLastFile + 1, -1);
+    vector<int> vFileMinHeight(nLastFile + 1, std::numeric_limits<int>::max());
+    for (unsigned int i = 0; i < vBlockPos.size(); i++)
+    {
+        unsigned int nFile = vBlockPos[i].first.first;
+        vFileMaxHeight[nFile] = std::max(vFileMaxHeight[nFile], vBlockPos[i].second);
+        vFileMinHeight[nFile] = std::min(vFileMinHeight[nFile], vBlockPos[i].second);
+    }
+
+    if (vFileMaxHeight[nFirstFile] > nPruneHeight)
+    {
+        // Look again once the newest block in the file is deep enough
+        LOCK(cs_main);
+        nPruneCheckHeight = nBestHeight + std::max(vFileMaxHeight[nFirstFile] - nPruneHeight, PRUNE_CHECK_INTERVAL);
+        return true;
+    }
+
+    // Heights of the blocks in files that are partly deep enough, to tell
+    // which spends can still be disconnected
+    map<pair<unsigned int, unsigned int>, int> mapBlockHeight;
+    for (unsigned int i = 0; i < vBlockPos.size(); i++)
+    {
+        unsigned int nFile = vBlockPos[i].first.first;
+        if (vFileMinHeight[nFile] <= nPruneHeight && vFileMaxHeight[nFile] > nPruneHeight)
+            mapBlockHeight.insert(vBlockPos[i]);
+    }
+    vector<pair<pair<unsigned int, unsigned int>, int> >().swap(vBlockPos);
+
+    if (!PruneBlockFile(nFirstFile, vBlocks, nPruneHeight, vFileMaxHeight, mapBlockHeight))
+        return false;
+
+    // More files may be due
+    LOCK(cs_main);
+    nPruneCheckHeight = nBestHeight + 1;
+    return true;
+}
+
+void ThreadPruneBlockFiles(void* parg)
+{
+    // Make this thread recognisable as the block file pruning thread
+    RenameThread("novacoin-prune");
+
+    while (!fShutdown)
+    {
+        Sleep(1000);
+
+        try {
+            PruneBlockFiles();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadPruneBlockFiles()");
+        }
+    }
+}
+
+void UnloadBlockIndex()
+{
+    SetMainChainTip(NULL);
+    mapBlockIndex.clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+    nBestHeight = 0;
+    nBestChainTrust = 0;
+    nBestInvalidTrust = 0;
+    hashBestChain = 0;
+    pindexBest = NULL;
+}
+
+//
+// Block index snapshot. Written on clean shutdown and used on the next start
+// instead of scanning and re-hashing every block index record in the txdb.
+//
+// Version 2: snapshots written by version 1 could carry chain trust miscomputed
+// by the parallel index load and are discarded.
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 2;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    if (pindexBest == NULL)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Block data the snapshot refers to must be on disk first
+    if (!FlushBlockFiles())
+        return false;
+
+    // serialize index entries, checksum data up to that point, then append csum
+    CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+    ssIndex << FLATDATA(pchMessageStart);
+    ssIndex << BLOCKINDEX_SNAPSHOT_VERSION << CLIENT_VERSION;
+    ssIndex << hashBestChain;
+    ssIndex << (unsigned int)mapBlockIndex.size();
+    // Entries go in height order, so skip pointers can be built while reading
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        ssIndex << pindex->GetBlockHash() << CDiskBlockIndex(pindex);
+        ssIndex << pindex->nChainTrust << pindex->nStakeModifierChecksum;
+    }
+    ssIndex << setStakeSeen;
+    uint256 hash = Hash(ssIndex.begin(), ssIndex.end());
+    ssIndex << hash;
+
+    // write to a temporary file and move it into place once committed
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout.write(&ssIndex[0], ssIndex.size());
+    }
+    catch (const std::exception&) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    printf("WriteBlockIndexSnapshot(): wrote %" PRIszu " entries in %" PRId64 "ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+static CBlockIndex* InsertSnapshotIndex(const uint256& hash)
+{
+    if (hash == 0)
+        return NULL;
+
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+
+    CBlockIndex* pindexNew = mapBlockIndex.NewIndex();
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+
+    return pindexNew;
+}
+
+static bool ReadBlockIndexSnapshotInner(const boost::filesystem::path& pathSnapshot, const uint256& hashBestChainDB)
+{
+    // read the whole file with one sequential read
+    FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize <= 0)
+        return error("ReadBlockIndexSnapshot() : file too small");
+    vector<char> vchData(dataSize);
+    uint256 hashIn;
+    try {
+        filein.read(&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (const std::exception&) {
+        return error("ReadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    if (hashIn != Hash(vchData.begin(), vchData.end()))
+        return error("ReadBlockIndexSnapshot() : checksum mismatch; data corrupted");
+
+    CDataStream ssIndex(vchData, SER_DISK, CLIENT_VERSION);
+    vector<char>().swap(vchData);
+
+    unsigned int nEntries = 0;
+    try {
+        unsigned char pchMsgTmp[4];
+        int nSnapshotVersion, nClientVersion;
+        uint256 hashBestChainSnapshot;
+        ssIndex >> FLATDATA(pchMsgTmp) >> nSnapshotVersion >> nClientVersion >> hashBestChainSnapshot;
+
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("ReadBlockIndexSnapshot() : invalid network magic number");
+        if (nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION || nClientVersion != CLIENT_VERSION)
+            return error("ReadBlockIndexSnapshot() : written by another version (%d, %d)", nSnapshotVersion, nClientVersion);
+        // The txdb may have moved on without us, e.g. after running an older client
+        if (hashBestChainSnapshot != hashBestChainDB)
+            return error("ReadBlockIndexSnapshot() : best chain %s does not match the database", hashBestChainSnapshot.ToString().substr(0,20).c_str());
+
+        ssIndex >> nEntries;
+        mapBlockIndex.reserve(nEntries);
+        for (unsigned int i = 0; i < nEntries; i++)
+        {
+            uint256 blockHash;
+            CDiskBlockIndex diskindex;
+            ssIndex >> blockHash >> diskindex;
+
+            CBlockIndex* pindexNew = InsertSnapshotIndex(blockHash);
+            pindexNew->pprev          = InsertSnapshotIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertSnapshotIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            ssIndex >> pindexNew->nChainTrust >> pindexNew->nStakeModifierChecksum;
+
+            if (pindexNew->pprev && pindexNew->pprev->nHeight + 1 != pindexNew->nHeight)
+                return error("ReadBlockIndexSnapshot() : entry at height %d out of order", pindexNew->nHeight);
+            pindexNew->BuildSkip();
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                pindexGenesisBlock = pindexNew;
+
+            if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+                return error("ReadBlockIndexSnapshot() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, pindexNew->nStakeModifier);
+        }
+        ssIndex >> setStakeSeen;
+    }
+    catch (const std::exception&) {
+        return error("ReadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+
+    // Every referenced block must have had an entry of its own
+    if (mapBlockIndex.size() != nEntries || !mapBlockIndex.count(hashBestChainDB))
+        return error("ReadBlockIndexSnapshot() : incomplete index");
+
+    return true;
+}
+
+bool ReadBlockIndexSnapshot(const uint256& hashBestChainDB)
+{
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(pathSnapshot))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = ReadBlockIndexSnapshotInner(pathSnapshot, hashBestChainDB);
+
+    // The snapshot only describes the state at the last clean shutdown, so it
+    // is removed once used. An unclean exit then falls back to a full scan.
+    boost::filesystem::remove(pathSnapshot);
+
+    if (!fLoaded)
+    {
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        pindexGenesisBlock = NULL;
+        return false;
+    }
+
+    printf("ReadBlockIndexSnapshot(): loaded %" PRIszu " entries in %" PRId64 "ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+//
+// Memory pool dump. Written on shutdown and every few minutes, read back on
+// startup so that block templates don't start out empty.
+//
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+static boost::filesystem::path GetMempoolDumpPath()
+{
+    return GetDataDir() / "mempool.dat";
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // serialize transactions oldest first with their entry times, then csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << MEMPOOL_DUMP_VERSION;
+    unsigned int nCount = 0;
+    {
+        LOCK(mempool.cs);
+        nCount = mempool.setByTime.size();
+        ssMempool << nCount;
+        for (set<pair<int64_t, uint256> >::const_iterator it = mempool.setByTime.begin(); it != mempool.setByTime.end(); ++it)
+            ssMempool << mempool.mapTx[(*it).second] << (*it).first;
+    }
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    // write to a temporary file and move it into place once committed
+    boost::filesystem::path pathMempool = GetMempoolDumpPath();
+    boost::filesystem::path pathTmp = pathMempool.string() + ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout.write(&ssMempool[0], ssMempool.size());
+    }
+    catch (const std::exception&) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    printf("DumpMempool(): wrote %u transactions in %" PRId64 "ms\n", nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path pathMempool = GetMempoolDumpPath();
+    if (!boost::filesystem::exists(pathMempool))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadMempool() : open failed");
+
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize <= 0)
+        return error("LoadMempool() : file too small");
+    vector<char> vchData(dataSize);
+    uint256 hashIn;
+    try {
+        filein.read(&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (const std::exception&) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    if (hashIn != Hash(vchData.begin(), vchData.end()))
+        return error("LoadMempool() : checksum mismatch; data corrupted");
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    vector<char>().swap(vchData);
+
+    vector<CTransaction> vtx;
+    vector<int64_t> vTime;
+    try {
+        unsigned char pchMsgTmp[4];
+        ssMempool >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+
+        int nVersion;
+        ssMempool >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %d", nVersion);
+
+        unsigned int nCount;
+        ssMempool >> nCount;
+        vtx.resize(nCount);
+        vTime.resize(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+            ssMempool >> vtx[i] >> vTime[i];
+    }
+    catch (const std::exception&) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+
+    unsigned int nExpired = 0, nFailed = 0;
+    size_t nPoolSize = 0;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+
+        int64_t nTimeCutoff = GetTime() - nMempoolExpiry;
+        vector<unsigned int> vPending;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            if (vTime[i] < nTimeCutoff)
+                nExpired++;
+            else
+                vPending.push_back(i);
+        }
+
+        // A transaction whose parent comes later in the file is retried
+        vector<unsigned int> vAccepted;
+        bool fProgress = true;
+        while (!vPending.empty() && fProgress)
+        {
+            vector<CTransaction*> vptx;
+            BOOST_FOREACH(unsigned int i, vPending)
+                vptx.push_back(&vtx[i]);
+            vector<int> vResult;
+            mempool.acceptBatch(txdb, vptx, vResult);
+
+            fProgress = false;
+            vector<unsigned int> vRetry;
+            for (unsigned int j = 0; j < vPending.size(); j++)
+            {
+                if (vResult[j] == BATCH_ACCEPTED)
+                {
+                    vAccepted.push_back(vPending[j]);
+                    fProgress = true;
+                }
+                else if (vResult[j] == BATCH_MISSING_INPUTS)
+                    vRetry.push_back(vPending[j]);
+                else
+                    nFailed++;
+            }
+            vPending.swap(vRetry);
+        }
+        nFailed += vPending.size();
+
+        // Entry times survive the restart, so expiry is unaffected by it
+        BOOST_FOREACH(unsigned int i, vAccepted)
+            mempool.setEntryTime(vtx[i].GetHash(), vTime[i]);
+
+        nPoolSize = mempool.size();
+    }
+
+    printf("LoadMempool(): %" PRIszu " transactions in pool, %u expired, %u failed, %" PRId64 "ms\n",
+           nPoolSize, nExpired, nFailed, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadBlockIndex(bool fAllowNew)
+{
+    if (fTestNet)
+    {
+        pchMessageStart[0] = 0xcd;
+        pchMessageStart[1] = 0xf2;
+        pchMessageStart[2] = 0xc0;
+        pchMessageStart[3] = 0xef;
+
+        bnProofOfWorkLimit = bnProofOfWorkLimitTestNet; // 16 bits PoW target limit for testnet
+        nStakeMinAge = 2 * nOneHour; // test net min age is 2 hours
+        nModifierInterval = 20 * 60; // test modifier interval is 20 minutes
+        nCoinbaseMaturity = 10; // test maturity is 10 blocks
+        nStakeTargetSpacing = 5 * 60; // test block spacing is 5 minutes
+    }
+
+    //
+    // Load block index
+    //
+    CTxDB txdb("cr+");
+    if (!LoadPrunedBlockFiles(txdb))
+        return false;
+    if (!txdb.LoadBlockIndex())
+        return false;
+
+    //
+    // Init with genesis block
+    //
+    if (mapBlockIndex.empty())
+    {
+        if (!fAllowNew)
+            return false;
+
+        // Genesis block
+
+        // MainNet:
+
+        //CBlock(hash=00000a060336cbb72fe969666d337b87198b1add2abaa59cca226820b32933a4, ver=1, hashPrevBlock=0000000000000000000000000000000000000000000000000000000000000000, hashMerkleRoot=4cb33b3b6a861dcbc685d3e614a9cafb945738d6833f182855679f2fad02057b, nTime=1360105017, nBits=1e0fffff, nNonce=1575379, vtx=1, vchBlockSig=)
+        //  Coinbase(hash=4cb33b3b6a, nTime=1360105017, ver=1, vin.size=1, vout.size=1, nLockTime=0)
+        //    CTxIn(COutPoint(0000000000, 4294967295), coinbase 04ffff001d020f274468747470733a2f2f626974636f696e74616c6b2e6f72672f696e6465782e7068703f746f7069633d3133343137392e6d736731353032313936236d736731353032313936)
+        //    CTxOut(empty)
+        //  vMerkleTree: 4cb33b3b6a
+
+        // TestNet:
+
+        //CBlock(hash=0000c763e402f2436da9ed36c7286f62c3f6e5dbafce9ff289bd43d7459327eb, ver=1, hashPrevBlock=0000000000000000000000000000000000000000000000000000000000000000, hashMerkleRoot=4cb33b3b6a861dcbc685d3e614a9cafb945738d6833f182855679f2fad02057b, nTime=1360105017, nBits=1f00ffff, nNonce=46534, vtx=1, vchBlockSig=)
         //  Coinbase(hash=4cb33b3b6a, nTime=1360105017, ver=1, vin.size=1, vout.size=1, nLockTime=0)
         //    CTxIn(COutPoint(0000000000, 4294967295), coinbase 04ffff001d020f274468747470733a2f2f626974636f696e74616c6b2e6f72672f696e6465782e7068703f746f7069633d3133343137392e6d736731353032313936236d736731353032313936)
         //    CTxOut(empty)
@@ -2873,7 +5056,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2911,95 +5094,255 @@ void PrintBlockTree()
         for (int i = 0; i < nCol; i++)
             printf("| ");
 
-        // print item
-        CBlock block;
-        block.ReadFromDisk(pindex);
-        printf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %" PRIszu "",
-            pindex->nHeight,
-            pindex->nFile,
-            pindex->nBlockPos,
-            block.GetHash().ToString().c_str(),
-            block.nBits,
-            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()).c_str(),
-            FormatMoney(pindex->nMint).c_str(),
-            block.vtx.size());
+        // print item
+        CBlock block;
+        block.ReadFromDisk(pindex);
+        printf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %" PRIszu "",
+            pindex->nHeight,
+            pindex->nFile,
+            pindex->nBlockPos,
+            block.GetHash().ToString().c_str(),
+            block.nBits,
+            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()).c_str(),
+            FormatMoney(pindex->nMint).c_str(),
+            block.vtx.size());
+
+        PrintWallets(block);
+
+        // put the main time-chain first
+        vector<CBlockIndex*>& vNext = mapNext[pindex];
+        for (unsigned int i = 0; i < vNext.size(); i++)
+        {
+            if (vNext[i]->pnext)
+            {
+                swap(vNext[0], vNext[i]);
+                break;
+            }
+        }
+
+        // iterate children
+        for (unsigned int i = 0; i < vNext.size(); i++)
+            vStack.push_back(make_pair(nCol+i, vNext[i]));
+    }
+}
+
+// Bootstrap import pipeline. A reader thread pulls block records out of the
+// file in large sequential chunks, worker threads deserialize them and run
+// the context-free checks, and the calling thread hands the blocks to
+// ProcessBlock in file order, taking cs_main for one block at a time.
+class CBlockImport
+{
+private:
+    struct CItem
+    {
+        std::vector<unsigned char> vchData;
+        bool fCompressed;           // a -compressblocks record, inflated by the worker
+        CBlock block;
+        bool fDone;
+        bool fOk;
+
+        CItem() : fCompressed(false), fDone(false), fOk(false) {}
+    };
+
+    static const unsigned int MAX_QUEUE_BLOCKS = 1024;
+    static const uint64_t MAX_QUEUE_BYTES = 64 * 1024 * 1024;
+
+    FILE* fileIn;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CItem*> queue;
+    unsigned int nNextCheck;    // first item in the queue not yet taken by a worker
+    uint64_t nQueuedBytes;
+    bool fReadDone;
+    bool fAbort;
+
+public:
+    uint64_t nBlocksRead;
+    uint64_t nBytesRead;
+
+    CBlockImport(FILE* fileInIn) : fileIn(fileInIn), nNextCheck(0), nQueuedBytes(0), fReadDone(false), fAbort(false), nBlocksRead(0), nBytesRead(0) {}
+
+    ~CBlockImport()
+    {
+        BOOST_FOREACH(CItem* pitem, queue)
+            delete pitem;
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        cond.notify_all();
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("novacoin-loadblk");
+
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof() && !fRequestShutdown)
+        {
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[sizeof(pchMessageStart)];
+                blkdat.FindByte(pchMessageStart[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, pchMessageStart, sizeof(pchMessageStart)))
+                    continue;
+                // read size, block files written with -compressblocks flag
+                // compressed records in it
+                blkdat >> nSize;
+                if ((nSize & ~BLOCKFILE_COMPRESSED) == 0 || (nSize & ~BLOCKFILE_COMPRESSED) > MAX_BLOCK_SIZE)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+
+            CItem* pitem = new CItem();
+            pitem->fCompressed = (nSize & BLOCKFILE_COMPRESSED) != 0;
+            nSize &= ~BLOCKFILE_COMPRESSED;
+            try {
+                blkdat.SetLimit(blkdat.GetPos() + nSize);
+                pitem->vchData.resize(nSize);
+                blkdat.read((char*)&pitem->vchData[0], nSize);
+                nRewind = blkdat.GetPos();
+            } catch (const std::exception&) {
+                printf("%s() : Deserialize or I/O error caught during load\n", BOOST_CURRENT_FUNCTION);
+                delete pitem;
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fAbort && (queue.size() >= MAX_QUEUE_BLOCKS || nQueuedBytes >= MAX_QUEUE_BYTES))
+                cond.wait(lock);
+            if (fAbort)
+            {
+                delete pitem;
+                break;
+            }
+            queue.push_back(pitem);
+            nQueuedBytes += nSize;
+            nBlocksRead++;
+            nBytesRead += nSize + sizeof(pchMessageStart) + sizeof(nSize);
+            cond.notify_all();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        cond.notify_all();
+    }
 
-        PrintWallets(block);
+    void ThreadCheck()
+    {
+        RenameThread("novacoin-loadchk");
 
-        // put the main time-chain first
-        vector<CBlockIndex*>& vNext = mapNext[pindex];
-        for (unsigned int i = 0; i < vNext.size(); i++)
+        for ( ; ; )
         {
-            if (vNext[i]->pnext)
+            CItem* pitem;
             {
-                swap(vNext[0], vNext[i]);
-                break;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && nNextCheck == queue.size() && !fReadDone)
+                    cond.wait(lock);
+                if (fAbort || nNextCheck == queue.size())
+                    return;
+                pitem = queue[nNextCheck++];
+            }
+
+            // Same preparation and checks as ProcessBlock does before
+            // looking at the chain
+            try {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                if (!pitem->fCompressed)
+                    ss.write((const char*)&pitem->vchData[0], pitem->vchData.size());
+                else if (!InflateBlockRecord(pitem->vchData, ss))
+                    throw std::runtime_error("compressed block record could not be inflated");
+                ss >> pitem->block;
+                if (!IsCanonicalBlockSignature(&pitem->block) && !ReserealizeBlockSignature(&pitem->block))
+                    printf("WARNING: LoadExternalBlockFile() : ReserealizeBlockSignature FAILED\n");
+                pitem->fOk = pitem->block.CheckBlock(true, true, (pitem->block.nTime > Checkpoints::GetLastCheckpointTime()));
+            } catch (const std::exception&) {
+                printf("%s() : Deserialize or I/O error caught during load\n", BOOST_CURRENT_FUNCTION);
+                pitem->fOk = false;
             }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pitem->fDone = true;
+            cond.notify_all();
         }
+    }
 
-        // iterate children
-        for (unsigned int i = 0; i < vNext.size(); i++)
-            vStack.push_back(make_pair(nCol+i, vNext[i]));
+    // Next block in file order that passed the checks, or NULL at the end
+    bool GetNext(CBlock& block)
+    {
+        for ( ; ; )
+        {
+            CItem* pitem;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && (queue.empty() || !queue.front()->fDone) && !(fReadDone && queue.empty()))
+                    cond.wait(lock);
+                if (fAbort || queue.empty())
+                    return false;
+                pitem = queue.front();
+                queue.pop_front();
+                nNextCheck--;
+                nQueuedBytes -= pitem->vchData.size();
+                cond.notify_all();
+            }
+
+            bool fOk = pitem->fOk;
+            if (fOk)
+                block = pitem->block;
+            else
+                printf("LoadExternalBlockFile() : skipping block %s that failed CheckBlock\n", pitem->block.GetHash().ToString().substr(0,20).c_str());
+            delete pitem;
+            if (fOk)
+                return true;
+        }
     }
-}
+};
 
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    CBlockImport import(fileIn);
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(boost::bind(&CBlockImport::ThreadRead, &import));
+    for (int i = 0; i < std::max(nScriptCheckThreads, 1); i++)
+        threadGroup.create_thread(boost::bind(&CBlockImport::ThreadCheck, &import));
+
+    int64_t nLastReport = nStart;
+    CBlock block;
+    while (!fRequestShutdown && import.GetNext(block))
     {
-        LOCK(cs_main);
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != std::numeric_limits<uint32_t>::max() && blkdat.good() && !fRequestShutdown)
-            {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    size_t nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = std::numeric_limits<uint32_t>::max();
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == std::numeric_limits<uint32_t>::max())
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
-                }
-            }
+        {
+            LOCK(cs_main);
+            if (ProcessBlock(NULL, &block, true))
+                nLoaded++;
         }
-        catch (const std::exception&) {
-            printf("%s() : Deserialize or I/O error caught during load\n",
-                   BOOST_CURRENT_FUNCTION);
+
+        if (GetTimeMillis() - nLastReport >= 10000)
+        {
+            nLastReport = GetTimeMillis();
+            printf("LoadExternalBlockFile() : %i blocks loaded, %" PRIu64 " read (%.1f MB)\n", nLoaded, import.nBlocksRead, import.nBytesRead / 1048576.0);
         }
     }
-    printf("Loaded %i blocks from external file in %" PRId64 "ms\n", nLoaded, GetTimeMillis() - nStart);
+    import.Abort();
+    threadGroup.join_all();
+    fclose(fileIn);
+
+    int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+    printf("Loaded %i blocks from external file in %" PRId64 "ms (%.1f blocks/s, %.2f MB/s)\n",
+        nLoaded, nElapsed, nLoaded * 1000.0 / nElapsed, import.nBytesRead * 1000.0 / 1048576.0 / nElapsed);
     return nLoaded > 0;
 }
 
@@ -3105,12 +5448,344 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
+//
+// Headers-first download. The sync node's headers tell which blocks follow
+// pindexBest, and these are then requested from every peer that has them in
+// a moving window. Headers only decide what is downloaded; the blocks still
+// go through ProcessBlock as usual.
+//
+static const unsigned int MAX_HEADERS_AHEAD = 20000;
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int MAX_BLOCKS_IN_FLIGHT = 16;
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60 * 1000000;
+static const int64_t HEADER_CHAIN_STALL_TIMEOUT = 5 * 60 * 1000000;
+
+// Best height and time when the main chain last advanced along the header chain
+static int nHeaderChainBestHeight = -1;
+static int64_t nHeaderChainProgress = 0;
+
+static void ClearHeaderChain()
+{
+    vHeaderChain.clear();
+    mapHeaderChain.clear();
+    if (pnodeHeaderChain)
+    {
+        LOCK(cs_vNodes);
+        pnodeHeaderChain->Release();
+        pnodeHeaderChain = NULL;
+    }
+}
+
+// Abandon the header chain and blame the peer it came from
+static void RejectHeaderChain(int nMisbehavior)
+{
+    if (pnodeHeaderChain)
+        pnodeHeaderChain->Misbehaving(nMisbehavior);
+    ClearHeaderChain();
+}
+
+// Drop the headers that made it into the main chain. The header chain is
+// abandoned if the main chain went elsewhere or stopped advancing along it.
+static void PruneHeaderChain(int64_t nNow)
+{
+    if (vHeaderChain.empty())
+        return;
+    if (pnodeHeaderChain && pnodeHeaderChain->fDisconnect)
+    {
+        ClearHeaderChain();
+        return;
+    }
+    if (nBestHeight != nHeaderChainBestHeight)
+    {
+        nHeaderChainBestHeight = nBestHeight;
+        nHeaderChainProgress = nNow;
+    }
+    if (nNow - nHeaderChainProgress > HEADER_CHAIN_STALL_TIMEOUT)
+    {
+        printf("PruneHeaderChain() : no progress, dropping %" PRIszu " headers\n", vHeaderChain.size());
+        RejectHeaderChain(20);
+        return;
+    }
+
+    unsigned int nDrop = 0;
+    CBlockIndex* pindexLast = NULL;
+    while (nDrop < vHeaderChain.size() && nHeaderChainStart + (int)nDrop <= nBestHeight)
+    {
+        pindexLast = FindBlockByHeight(nHeaderChainStart + nDrop);
+        if (!pindexLast || pindexLast->GetBlockHash() != vHeaderChain[nDrop])
+        {
+            ClearHeaderChain();
+            return;
+        }
+        mapHeaderChain.erase(vHeaderChain[nDrop]);
+        nDrop++;
+    }
+    if (nDrop > 0)
+    {
+        vHeaderChain.erase(vHeaderChain.begin(), vHeaderChain.begin() + nDrop);
+        nHeaderChainStart += nDrop;
+        // Link the remaining headers to the main chain in place of the dropped ones
+        if (!vHeaderChain.empty())
+            mapHeaderChain[vHeaderChain[0]].pprev = pindexLast;
+    }
+}
+
+// Locator starting at the tip of the header chain
+static CBlockLocator GetHeaderChainLocator()
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vHeaderChain.size() - 1; i >= 0; i -= nStep, nStep *= 2)
+        vHave.push_back(vHeaderChain[i]);
+    CBlockIndex* pindex = pindexBest;
+    for (nStep = 1; pindex; pindex = pindex->GetAncestor(pindex->nHeight - nStep))
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return CBlockLocator(vHave);
+}
+
+static void PushGetHeaders(CNode* pnode)
+{
+    pnode->nLastGetHeaders = GetTimeMicros();
+    pnode->fGetHeadersPending = true;
+    pnode->PushMessage("getheaders", GetHeaderChainLocator(), uint256(0));
+}
+
+// Append a header to the header chain, which only ever extends pindexBest.
+// Returns false if the header doesn't fit, then the rest of the batch won't either.
+static bool AcceptHeader(CNode* pfrom, const CBlock& header)
+{
+    uint256 hash = header.GetHash();
+    if (mapHeaderChain.count(hash))
+        return true;
+
+    CBlockIndex* pindexPrev;
+    if (vHeaderChain.empty())
+    {
+        // Skip what we already have until the headers pass our best block
+        if (mapBlockIndex.count(hash))
+            return true;
+        if (header.hashPrevBlock != hashBestChain)
+            return false;
+        pindexPrev = pindexBest;
+    }
+    else
+    {
+        if (header.hashPrevBlock != vHeaderChain.back())
+            return false;
+        pindexPrev = &mapHeaderChain[vHeaderChain.back()];
+    }
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (vHeaderChain.size() >= MAX_HEADERS_AHEAD)
+        return false;
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptHeader() : header %s timestamp too far in the future", hash.ToString().substr(0,20).c_str());
+
+    // Proof-of-stake blocks have a zero nonce, so a header with a zero nonce
+    // and the stake target required after its parent is taken for one; its
+    // stake can only be checked once the block arrives. Any other header must
+    // carry valid proof-of-work at the required target, so a chain of
+    // minimum difficulty headers is turned down.
+    bool fProofOfStake = header.nNonce == 0 && header.nBits == GetNextTargetRequired(pindexPrev, true);
+    if (!fProofOfStake)
+    {
+        if (header.nBits != GetNextTargetRequired(pindexPrev, false))
+        {
+            pfrom->Misbehaving(100);
+            return error("AcceptHeader() : incorrect target for header %s", hash.ToString().substr(0,20).c_str());
+        }
+        if (!CheckProofOfWork(hash, header.nBits))
+        {
+            pfrom->Misbehaving(100);
+            return error("AcceptHeader() : proof of work failed for header %s", hash.ToString().substr(0,20).c_str());
+        }
+    }
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+
+    if (vHeaderChain.empty())
+    {
+        nHeaderChainStart = nHeight;
+        nHeaderChainBestHeight = nBestHeight;
+        nHeaderChainProgress = GetTimeMicros();
+        LOCK(cs_vNodes);
+        pnodeHeaderChain = pfrom->AddRef();
+    }
+    vHeaderChain.push_back(hash);
+    map<uint256, CBlockIndex>::iterator mi = mapHeaderChain.insert(make_pair(hash, CBlockIndex())).first;
+    CBlockIndex& index = (*mi).second;
+    index.phashBlock = &(*mi).first;
+    index.pprev = pindexPrev;
+    index.nHeight = nHeight;
+    index.nVersion = header.nVersion;
+    index.hashMerkleRoot = header.hashMerkleRoot;
+    index.nTime = header.nTime;
+    index.nBits = header.nBits;
+    index.nNonce = header.nNonce;
+    if (fProofOfStake)
+        index.SetProofOfStake();
+    return true;
+}
+
+// Ask pto for the next blocks of the header chain that nobody is fetching yet
+static void RequestHeaderChainBlocks(CNode* pto, int64_t nNow)
+{
+    // Forget requests that were answered or have timed out
+    map<uint256, int64_t>::iterator it = pto->mapBlocksInFlight.begin();
+    while (it != pto->mapBlocksInFlight.end())
+    {
+        const uint256& hash = (*it).first;
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || nNow - (*it).second > BLOCK_DOWNLOAD_TIMEOUT)
+            pto->mapBlocksInFlight.erase(it++);
+        else
+            it++;
+    }
+
+    if (vHeaderChain.empty() || pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+
+    vector<CInv> vGetData;
+    for (unsigned int i = 0; i < vHeaderChain.size() && i < BLOCK_DOWNLOAD_WINDOW; i++)
+    {
+        if (pto->mapBlocksInFlight.size() >= MAX_BLOCKS_IN_FLIGHT || nHeaderChainStart + (int)i > pto->nStartingHeight)
+            break;
+        const uint256& hash = vHeaderChain[i];
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        // Skip blocks requested from another peer lately, or queued by AskFor
+        CInv inv(MSG_BLOCK, hash);
+        map<CInv, int64_t>::iterator mi = mapAlreadyAskedFor.find(inv);
+        if (mi != mapAlreadyAskedFor.end() && nNow - (*mi).second <= BLOCK_DOWNLOAD_TIMEOUT)
+            continue;
+
+        pto->mapBlocksInFlight[hash] = nNow;
+        mapAlreadyAskedFor[inv] = nNow;
+        vGetData.push_back(inv);
+    }
+    if (!vGetData.empty())
+    {
+        if (fDebugNet)
+            printf("requesting %" PRIszu " blocks from %s\n", vGetData.size(), pto->addr.ToString().c_str());
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+
+
 
 // The message start string is designed to be unlikely to occur in normal data.
 // The characters are rarely used upper ASCII, not valid as UTF-8, and produce
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xe4, 0xe8, 0xe9, 0xe5 };
 
+// Transactions from "tx" messages of the node being processed. They are
+// accepted as one batch once its receive buffer runs dry, another kind of
+// message comes in or the batch is full.
+static const unsigned int MAX_TX_BATCH = 512;
+static vector<CTransaction> vPendingTx;
+static CNode* pnodePendingTx = NULL;
+
+void static ProcessPendingTransactions()
+{
+    if (vPendingTx.empty())
+        return;
+
+    CNode* pfrom = pnodePendingTx;
+    vector<CTransaction> vtx;
+    vtx.swap(vPendingTx);
+    pnodePendingTx = NULL;
+
+    CTxDB txdb("r");
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+
+    vector<CTransaction*> vptx;
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        vptx.push_back(&tx);
+    vector<int> vResult;
+    mempool.acceptBatch(txdb, vptx, vResult);
+
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CTransaction& tx = vtx[i];
+        uint256 hash = tx.GetHash();
+        if (vResult[i] == BATCH_ACCEPTED)
+        {
+            SyncWithWallets(tx, NULL, true);
+            RelayTransaction(tx, hash);
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+            vWorkQueue.push_back(hash);
+            vEraseQueue.push_back(hash);
+        }
+        else if (vResult[i] == BATCH_MISSING_INPUTS)
+        {
+            AddOrphanTx(tx);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            if (nEvicted > 0)
+                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        }
+        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+    }
+
+    // Process orphan transactions that depended on the accepted ones, a
+    // batch per generation
+    while (!vWorkQueue.empty())
+    {
+        vector<CTransaction> vOrphan;
+        set<uint256> setQueued;
+        BOOST_FOREACH(const uint256& hashPrev, vWorkQueue)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hashPrev);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            BOOST_FOREACH(const uint256& orphanTxHash, (*itByPrev).second)
+                if (setQueued.insert(orphanTxHash).second)
+                    vOrphan.push_back(mapOrphanTransactions[orphanTxHash]);
+        }
+        vWorkQueue.clear();
+
+        vptx.clear();
+        BOOST_FOREACH(CTransaction& orphanTx, vOrphan)
+            vptx.push_back(&orphanTx);
+        mempool.acceptBatch(txdb, vptx, vResult);
+
+        for (unsigned int i = 0; i < vOrphan.size(); i++)
+        {
+            CTransaction& orphanTx = vOrphan[i];
+            uint256 orphanTxHash = orphanTx.GetHash();
+            if (vResult[i] == BATCH_ACCEPTED)
+            {
+                printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                SyncWithWallets(orphanTx, NULL, true);
+                RelayTransaction(orphanTx, orphanTxHash);
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
+                vWorkQueue.push_back(orphanTxHash);
+                vEraseQueue.push_back(orphanTxHash);
+            }
+            else if (vResult[i] == BATCH_REJECTED)
+            {
+                // invalid orphan
+                vEraseQueue.push_back(orphanTxHash);
+                printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+            }
+        }
+    }
+
+    BOOST_FOREACH(uint256 hash, vEraseQueue)
+        EraseOrphanTx(hash);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
@@ -3123,6 +5798,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
+    // Transactions queued so far come first
+    if (strCommand != "tx")
+        ProcessPendingTransactions();
+
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -3407,9 +6086,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk, if it wasn't pruned
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
+                if (mi != mapBlockIndex.end() && !(*mi).second->IsPruned())
                 {
                     CBlock block;
                     block.ReadFromDisk((*mi).second);
@@ -3474,6 +6153,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
         for (; pindex; pindex = pindex->pnext)
         {
+            // Blocks we no longer have can't be offered
+            if (pindex->IsPruned())
+            {
+                printf("  getblocks stopping at pruned block %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
+                break;
+            }
             if (pindex->GetBlockHash() == hashStop)
             {
                 printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
@@ -3519,7 +6204,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3545,70 +6230,54 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > 2000)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %" PRIszu "", vHeaders.size());
+        }
+        if (!fHeadersFirst)
+            return true;
+
+        // Only take headers we asked this peer for, and only from the peer
+        // the header chain came from
+        if (!pfrom->fGetHeadersPending)
+        {
+            printf("ignoring %" PRIszu " unsolicited headers from %s\n", vHeaders.size(), pfrom->addr.ToString().c_str());
+            return true;
+        }
+        pfrom->fGetHeadersPending = false;
+        PruneHeaderChain(GetTimeMicros());
+        if (pnodeHeaderChain && pnodeHeaderChain != pfrom)
+            return true;
+
+        unsigned int nHeadersBefore = vHeaderChain.size();
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+            if (!AcceptHeader(pfrom, header))
+                break;
+        printf("received %" PRIszu " headers, header chain %d to %d\n", vHeaders.size(), nHeaderChainStart, nHeaderChainStart + (int)vHeaderChain.size() - 1);
+
+        // A full batch means there is more to come
+        if (vHeaders.size() == 2000 && vHeaderChain.size() > nHeadersBefore && vHeaderChain.size() < MAX_HEADERS_AHEAD)
+            PushGetHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
-        {
-            SyncWithWallets(tx, NULL, true);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (orphanTx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+        if (pnodePendingTx != pfrom || vPendingTx.size() >= MAX_TX_BATCH)
+            ProcessPendingTransactions();
+        pnodePendingTx = pfrom;
+        vPendingTx.push_back(tx);
     }
 
 
@@ -3623,10 +6292,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, hashBlock);
         pfrom->AddInventoryKnown(inv);
+        pfrom->mapBlocksInFlight.erase(hashBlock);
 
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        if (block.nDoS)
+        {
+            pfrom->Misbehaving(block.nDoS);
+            // The header chain led us to an invalid block
+            if (mapHeaderChain.count(hashBlock))
+            {
+                printf("block %s of the header chain is invalid, dropping the header chain\n", hashBlock.ToString().substr(0,20).c_str());
+                if (pnodeHeaderChain == pfrom)
+                    ClearHeaderChain();
+                else
+                    RejectHeaderChain(20);
+            }
+        }
     }
 
 
@@ -3892,6 +6574,18 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
+    // Accept the transactions this node sent before moving on to the next one
+    try
+    {
+        LOCK(cs_main);
+        ProcessPendingTransactions();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
     vRecv.Compact();
     return true;
 }
@@ -3919,6 +6613,17 @@ bool SendMessages(CNode* pto)
         if (pto->fStartSync) {
             pto->fStartSync = false;
             pto->PushGetBlocks(pindexBest, uint256(0));
+            if (fHeadersFirst)
+                PushGetHeaders(pto);
+        }
+
+        // Keep the header chain of the sync node filled
+        if (fHeadersFirst)
+        {
+            PruneHeaderChain(nNow);
+            if (pto->nLastGetHeaders && nNow - pto->nLastGetHeaders > BLOCK_DOWNLOAD_TIMEOUT &&
+                vHeaderChain.size() < MAX_HEADERS_AHEAD / 2 && pto->nStartingHeight > nHeaderChainStart + (int)vHeaderChain.size())
+                PushGetHeaders(pto);
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4034,6 +6739,12 @@ bool SendMessages(CNode* pto)
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: getdata (blocks of the header chain)
+        //
+        if (fHeadersFirst)
+            RequestHeaderChainBlocks(pto, nNow);
+
     }
     return true;
 }
@@ -4045,9 +6756,6 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
 
         // orphan blocks
@@ -18,6 +18,8 @@
 #include <list>
 #include <map>
 
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -54,6 +56,12 @@ inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MO
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 // Maximum number of script-checking threads allowed
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+// Smallest -prune budget, block files are rolled over at a quarter of it
+static const uint64_t MIN_PRUNE_TARGET = 512 * 1024 * 1024;
+// Number of blocks below the best one that are never pruned
+static const int MIN_BLOCKS_TO_KEEP = 500;
+// Set in the size in front of a block on disk if the block is stored compressed
+static const unsigned int BLOCKFILE_COMPRESSED = 0x80000000;
 
 static const uint256 hashGenesisBlock("0x00000a060336cbb72fe969666d337b87198b1add2abaa59cca226820b32933a4");
 static const uint256 hashGenesisBlockTestNet("0x000c763e402f2436da9ed36c7286f62c3f6e5dbafce9ff289bd43d7459327eb");
@@ -63,7 +71,8 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 2 * nOneHour; } // up
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+class CBlockIndexMap;
+extern CBlockIndexMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nNodeLifespan;
@@ -90,6 +99,13 @@ extern int64_t nTransactionFee;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
 extern int nScriptCheckThreads;
+extern bool fHeadersFirst;
+extern uint64_t nMaxOrphanBlockBytes;
+extern uint64_t nMaxMempoolBytes;
+extern int64_t nMempoolExpiry;
+extern bool fPruneMode;
+extern uint64_t nPruneTarget;
+extern bool fCompressBlocks;
 extern const uint256 entropyStore[38];
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -99,19 +115,35 @@ class CReserveKey;
 class CTxDB;
 class CTxIndex;
 class CScriptCheck;
+template<typename T> class CCheckQueueControl;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+// fCheckedBlock: the caller already ran the context-free CheckBlock()
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock=false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+FILE* BorrowBlockFile(unsigned int nFile, bool& fPrunedRet);
+void ReturnBlockFile(unsigned int nFile, FILE* file, bool fPruned);
+bool MapBlockFilePos(unsigned int nFile, unsigned int& nPos);
+void CloseBlockFiles();
+bool FlushBlockFiles();
+void ThreadFlushBlockFiles(void* parg);
+void ThreadPruneBlockFiles(void* parg);
+bool CompressBlockData(const char* pbegin, const char* pend, std::vector<unsigned char>& vchRet);
+bool DecompressBlockData(const unsigned char* pbegin, const unsigned char* pend, char* pdest, unsigned int nDestSize);
+void GetBlockCompressionStats(uint64_t& nBlocks, uint64_t& nRawBytes, uint64_t& nStoredBytes, uint64_t& nReads, int64_t& nReadMicros);
 
 void UnloadBlockIndex();
 bool LoadBlockIndex(bool fAllowNew=true);
+bool WriteBlockIndexSnapshot();
+bool ReadBlockIndexSnapshot(const uint256& hashBestChainDB);
+bool DumpMempool();
+bool LoadMempool();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+void SetMainChainTip(CBlockIndex* pindexNew);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 bool LoadExternalBlockFile(FILE* fileIn);
@@ -120,6 +152,10 @@ bool LoadExternalBlockFile(FILE* fileIn);
 void ThreadScriptCheck(void* parg);
 // Stop the script checking threads
 void ThreadScriptCheckQuit();
+// Run an instance of the block checking thread
+void ThreadBlockCheck(void* parg);
+// Stop the block checking threads
+void ThreadBlockCheckQuit();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -132,6 +168,7 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
+void GetOrphanBlockStats(unsigned int& nCount, unsigned int& nSpilled, uint64_t& nBytes, uint64_t& nSpillBytes);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ResendWalletTransactions(bool fForceResend=false);
 
@@ -145,6 +182,97 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+/** Read-only stream on a block file. The handle is borrowed from a pool of
+ *  open block files and handed back when the reader goes out of scope, so
+ *  reading a block or transaction costs a seek instead of fopen/fclose.
+ */
+class CBlockFileReader
+{
+private:
+    unsigned int nFile;
+    bool fPruned; // handle is on the compacted file of a pruned block file
+    FILE* file;
+    short state;
+    short exceptmask;
+
+    // no copying, the handle goes back to the pool exactly once
+    CBlockFileReader(const CBlockFileReader&);
+    CBlockFileReader& operator=(const CBlockFileReader&);
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileReader(unsigned int nFileIn, unsigned int nPos, int nTypeIn, int nVersionIn) :
+        nFile(nFileIn), fPruned(false), file(BorrowBlockFile(nFileIn, fPruned)), state(0), exceptmask(std::ios::badbit | std::ios::failbit),
+        nType(nTypeIn), nVersion(nVersionIn)
+    {
+        if (file && !Seek(nPos))
+        {
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+    ~CBlockFileReader()
+    {
+        if (!file)
+            return;
+        // a handle in an unknown state is not worth keeping
+        if (good())
+            ReturnBlockFile(nFile, file, fPruned);
+        else
+            fclose(file);
+    }
+
+    bool operator!() const { return (file == NULL); }
+    bool IsPruned() const { return fPruned; }
+
+    bool Seek(unsigned int nPos)
+    {
+        if (fPruned && !MapBlockFilePos(nFile, nPos))
+            return false;
+        return fseek(file, nPos, SEEK_SET) == 0;
+    }
+
+    //
+    // Stream subset
+    //
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+    bool good() const            { return state == 0; }
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize)
+    {
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::read : file handle is NULL");
+        if (fread(pch, 1, nSize, file) != nSize)
+            setstate(std::ios::failbit, feof(file) ? "CBlockFileReader::read : end of file" : "CBlockFileReader::read : fread failed");
+        return (*this);
+    }
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::operator>> : file handle is NULL");
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+// Read the rest of a compressed block whose size field was just read, and
+// return the whole block serialized as it would be stored uncompressed
+bool ReadCompressedBlock(CBlockFileReader& filein, unsigned int nSize, CDataStream& ssRet);
+
 /** Position on disk for a particular transaction. */
 class CDiskTxPos
 {
@@ -198,6 +326,33 @@ public:
 
 
 
+/** A range of a pruned block file that was kept, and where it went in the
+ *  compacted file. Positions in the original file stay valid through these.
+ */
+class CPrunedRange
+{
+public:
+    uint32_t nBegin;
+    uint32_t nEnd;
+    uint32_t nPrunedPos;
+
+    CPrunedRange()
+    {
+        nBegin = nEnd = nPrunedPos = 0;
+    }
+
+    CPrunedRange(unsigned int nBeginIn, unsigned int nEndIn, unsigned int nPrunedPosIn)
+    {
+        nBegin = nBeginIn;
+        nEnd = nEndIn;
+        nPrunedPos = nPrunedPosIn;
+    }
+
+    IMPLEMENT_SERIALIZE( READWRITE(FLATDATA(*this)); )
+};
+
+
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -607,30 +762,35 @@ public:
 
     int64_t GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=false, enum GetMinFee_mode mode=GMF_BLOCK, unsigned int nBytes = 0) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
+    bool ReadFromDisk(CDiskTxPos pos)
     {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+        // Start at the size in front of the block, which tells whether
+        // the block has to be decompressed to get at the transaction
+        unsigned int nSize = 0;
+        CBlockFileReader filein(pos.nFile, pos.nBlockPos - sizeof(nSize), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
 
-        // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
         try {
-            filein >> *this;
+            filein >> nSize;
+            if (nSize & BLOCKFILE_COMPRESSED)
+            {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                if (!ReadCompressedBlock(filein, nSize, ss))
+                    return error("CTransaction::ReadFromDisk() : ReadCompressedBlock failed");
+                ss.ignore(pos.nTxPos - pos.nBlockPos);
+                ss >> *this;
+            }
+            else
+            {
+                if (!filein.Seek(pos.nTxPos))
+                    return error("CTransaction::ReadFromDisk() : fseek failed");
+                filein >> *this;
+            }
         }
         catch (const std::exception&) {
             return error("%s() : deserialize or I/O error", BOOST_CURRENT_FUNCTION);
         }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
         return true;
     }
 
@@ -733,14 +893,18 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashCache> pcache;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache>& pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pcache(pcacheIn) { }
 
     bool operator()() const;
+    // Whether a failed check passes without the STRICT_FLAGS policy rules
+    bool IsStrictOnlyFailure() const;
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
@@ -748,6 +912,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pcache.swap(check.pcache);
     }
 };
 
@@ -892,6 +1057,11 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: scrypt hash of the header as it was when last hashed
+    mutable unsigned char pchHashedHeader[80];
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -935,6 +1105,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
         nDoS = 0;
     }
 
@@ -945,7 +1116,16 @@ public:
 
     uint256 GetHash() const
     {
-        return scrypt_blockhash((const uint8_t*)&nVersion);
+        // The header fields are public and get changed in place (nonce,
+        // time, merkle root), so the cached hash is only reused as long as
+        // the 80 header bytes are the ones it was computed from
+        if (!fHashCached || memcmp(pchHashedHeader, &nVersion, sizeof(pchHashedHeader)) != 0)
+        {
+            memcpy(pchHashedHeader, &nVersion, sizeof(pchHashedHeader));
+            hashCached = scrypt_blockhash((const uint8_t*)&nVersion);
+            fHashCached = true;
+        }
+        return hashCached;
     }
 
     int64_t GetBlockTime() const
@@ -1022,6 +1202,15 @@ public:
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // Hash of vtx[nTx] from the merkle tree. Only valid while the tree matches
+    // vtx, as it does after CheckBlock() until the transactions are changed.
+    uint256 GetTxHash(unsigned int nTx) const
+    {
+        if (nTx < vtx.size() && nTx < vMerkleTree.size())
+            return vMerkleTree[nTx];
+        return vtx[nTx].GetHash();
+    }
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
         if (vMerkleTree.empty())
@@ -1054,46 +1243,49 @@ public:
     }
 
 
-    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
-
-        return true;
-    }
+    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet);
 
     bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
     {
         SetNull();
 
         // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
+        CBlockFileReader filein(nFile, nBlockPos, SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        // Only headers and transactions still in use are left of a pruned file
+        if (fReadTransactions && filein.IsPruned())
+            return error("CBlock::ReadFromDisk() : block data pruned");
         if (!fReadTransactions)
             filein.nType |= SER_BLOCKHEADERONLY;
 
         // Read block
         try {
-            filein >> *this;
+            // A whole block is fetched with a single read using the size
+            // stored in front of it by WriteToDisk, and parsed from memory
+            unsigned int nSize = 0;
+            if (fReadTransactions && nBlockPos >= sizeof(nSize) && filein.Seek(nBlockPos - sizeof(nSize)))
+                filein >> nSize;
+            if (nSize & BLOCKFILE_COMPRESSED)
+            {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                if (!ReadCompressedBlock(filein, nSize, ss))
+                    return error("CBlock::ReadFromDisk() : ReadCompressedBlock failed");
+                ss >> *this;
+            }
+            else if (nSize > 0 && nSize <= MAX_SIZE)
+            {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                ss.resize(nSize);
+                filein.read(&ss[0], nSize);
+                ss >> *this;
+            }
+            else
+            {
+                if (!filein.Seek(nBlockPos))
+                    return error("CBlock::ReadFromDisk() : fseek failed");
+                filein >> *this;
+            }
         }
         catch (const std::exception&) {
             return error("%s() : deserialize or I/O error", BOOST_CURRENT_FUNCTION);
@@ -1131,7 +1323,8 @@ public:
 
 
     bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex);
-    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false);
+    // If pcontrol is given, script checks are queued on it and waiting for them is left to the caller
+    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck=false, CCheckQueueControl<CScriptCheck>* pcontrol=NULL);
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
@@ -1162,6 +1355,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // an ancestor further back, see GetAncestor(); in-memory only
     uint32_t nFile;
     uint32_t nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
@@ -1175,7 +1369,8 @@ public:
     {
         BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
-        BLOCK_STAKE_MODIFIER = (1 << 2)  // regenerated stake modifier
+        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+        BLOCK_PRUNED         = (1 << 3)  // full block no longer kept on disk
     };
 
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
@@ -1198,6 +1393,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1223,6 +1419,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1277,6 +1474,13 @@ public:
 
     uint256 GetBlockTrust() const;
 
+    // Set pskip from pprev, which must have its own skip pointer built already
+    void BuildSkip();
+
+    // Ancestor at the given height in logarithmic time, NULL if out of range
+    CBlockIndex* GetAncestor(int nAncestorHeight);
+    const CBlockIndex* GetAncestor(int nAncestorHeight) const;
+
     bool IsInMainChain() const
     {
         return (pnext || this == pindexBest);
@@ -1363,6 +1567,16 @@ public:
             nFlags |= BLOCK_STAKE_MODIFIER;
     }
 
+    bool IsPruned() const
+    {
+        return (nFlags & BLOCK_PRUNED) != 0;
+    }
+
+    void SetPruned()
+    {
+        nFlags |= BLOCK_PRUNED;
+    }
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(nprev=%p, pnext=%p, nFile=%u, nBlockPos=%-6d nHeight=%d, nMint=%s, nMoneySupply=%s, nFlags=(%s)(%d)(%s), nStakeModifier=%016" PRIx64 ", nStakeModifierChecksum=%08x, hashProofOfStake=%s, prevoutStake=(%s), nStakeTime=%d merkle=%s, hashBlock=%s)",
@@ -1485,6 +1699,105 @@ public:
 
 
 
+/** Map of block hashes to block index entries.
+ *
+ * An open addressing hash table with linear probing. Block hashes are
+ * uniformly distributed, so the low 64 bits of the hash are used directly
+ * as the bucket number. Buckets only hold 32-bit entry positions. The
+ * (hash, index) pairs and the CBlockIndex objects themselves are allocated
+ * from arenas in large chunks. They never move, so CBlockIndex::phashBlock
+ * may point to the stored hash, and growing the table only rewrites the
+ * bucket array. Entries are never erased one by one; iteration is in
+ * insertion order.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+
+    template<typename V, typename M>
+    class iterator_base
+    {
+    private:
+        M* pmap;
+        size_t nPos;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        iterator_base() : pmap(NULL), nPos(0) { }
+        iterator_base(M* pmapIn, size_t nPosIn) : pmap(pmapIn), nPos(nPosIn) { }
+        template<typename V2, typename M2>
+        iterator_base(const iterator_base<V2, M2>& it) : pmap(it.GetMap()), nPos(it.GetPos()) { }
+
+        M* GetMap() const { return pmap; }
+        size_t GetPos() const { return nPos; }
+
+        V& operator*() const { return pmap->Entry(nPos); }
+        V* operator->() const { return &pmap->Entry(nPos); }
+        iterator_base& operator++() { ++nPos; return *this; }
+        iterator_base operator++(int) { iterator_base ret = *this; ++nPos; return ret; }
+        bool operator==(const iterator_base& it) const { return nPos == it.nPos; }
+        bool operator!=(const iterator_base& it) const { return nPos != it.nPos; }
+    };
+
+    typedef iterator_base<value_type, CBlockIndexMap> iterator;
+    typedef iterator_base<const value_type, const CBlockIndexMap> const_iterator;
+
+private:
+    // Number of entries allocated at once by the arenas
+    static const size_t nChunkSize = 4096;
+
+    std::vector<uint32_t> vBuckets; // entry position + 1, zero marks an empty bucket; size is a power of two
+    std::vector<value_type*> vEntryChunks;
+    std::vector<CBlockIndex*> vIndexChunks;
+    size_t nSize;
+    size_t nIndexes;
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    void operator=(const CBlockIndexMap&);
+
+    size_t Bucket(const uint256& hash) const { return (size_t)hash.Get64() & (vBuckets.size() - 1); }
+    void Rehash(size_t nBuckets);
+
+public:
+    CBlockIndexMap() : nSize(0), nIndexes(0) { }
+    ~CBlockIndexMap() { clear(); }
+
+    value_type& Entry(size_t nPos) { return vEntryChunks[nPos / nChunkSize][nPos % nChunkSize]; }
+    const value_type& Entry(size_t nPos) const { return vEntryChunks[nPos / nChunkSize][nPos % nChunkSize]; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, nSize); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, nSize); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash);
+    const_iterator find(const uint256& hash) const { return const_iterator(const_cast<CBlockIndexMap*>(this)->find(hash)); }
+    size_t count(const uint256& hash) const { return find(hash) != end() ? 1 : 0; }
+    std::pair<iterator, bool> insert(const value_type& value);
+    CBlockIndex*& operator[](const uint256& hash) { return insert(value_type(hash, NULL)).first->second; }
+
+    // Make room for nEntries entries without growing the bucket array
+    void reserve(size_t nEntries);
+
+    // Construct a new block index object in the arena. It is owned by the
+    // map and destroyed by clear().
+    CBlockIndex* NewIndex();
+
+    void clear();
+};
+
+
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1506,7 +1819,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1542,8 +1855,10 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            if (pindex->IsInMainChain())
+                pindex = pindex->nHeight >= nStep ? FindBlockByHeight(pindex->nHeight - nStep) : NULL;
+            else
+                pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1557,7 +1872,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1576,7 +1891,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1592,7 +1907,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1619,19 +1934,122 @@ public:
 
 
 
+/** Block assembly data of a memory pool transaction, worked out once from its
+ *  inputs so that CreateNewBlock() doesn't have to read them again.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps;       // legacy and pay-to-script-hash
+    int64_t nValueInChain;      // value of the inputs confirmed in the chain
+    double dPriority;           // priority at nHeight
+    int nHeight;
+    int64_t nTime;              // when it entered the pool
+    bool fScored;               // fee and priority are known
+    bool fScriptChecked;        // signatures were verified on entry
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nSigOps = 0;
+        nValueInChain = 0;
+        dPriority = 0;
+        nHeight = 0;
+        nTime = 0;
+        fScored = false;
+        fScriptChecked = false;
+    }
+
+    // Unscored entry of a transaction added without input checks
+    explicit CTxMemPoolEntry(const CTransaction& tx);
+    CTxMemPoolEntry(const CTransaction& tx, const MapPrevTx& mapInputs, int nHeightIn, bool fScriptCheckedIn);
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    double GetFeePerKb() const
+    {
+        return double(nFee) / (double(nTxSize) / 1000.0);
+    }
+
+    // Confirmed inputs age by one confirmation per block
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+    }
+};
+
+/** Outcome of CTxMemPool::acceptBatch() for each transaction */
+enum
+{
+    BATCH_REJECTED = 0,
+    BATCH_ACCEPTED,
+    BATCH_MISSING_INPUTS,
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<std::pair<double, uint256> > setByFeeRate; // all transactions, lowest fee per kilobyte first, unscored at zero
+    std::set<std::pair<int64_t, uint256> > setByTime;   // all transactions, oldest first
+    uint64_t nTotalTxSize;
+    double dRollingMinFeePerKb;     // raised by evictions, decays over time
+    int64_t nLastRollingFeeUpdate;
+
+    CTxMemPool()
+    {
+        nTotalTxSize = 0;
+        dRollingMinFeePerKb = 0;
+        nLastRollingFeeUpdate = 0;
+    }
 
+    // With pvChecks set, script checks are handed back instead of being run.
+    // The caller must run them and remove the transaction if they fail.
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+                bool fCheckInputs, bool* pfMissingInputs,
+                std::vector<CScriptCheck>* pvChecks = NULL);
+    // Accept several transactions in order. Scripts of the whole batch are
+    // verified together on the script check threads, and the pool lock is
+    // held until the batch is settled, so unverified transactions are
+    // never visible. vResult gets one BATCH_* value per transaction.
+    void acceptBatch(CTxDB& txdb, const std::vector<CTransaction*>& vptx, std::vector<int>& vResult);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry* pentry = NULL);
     bool remove(CTransaction &tx);
+    bool removeWithDescendants(const uint256& hash);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    // Entries stay valid only while cs is held
+    const CTxMemPoolEntry& addEntry(const uint256& hash, const CTxMemPoolEntry& entry);
+    const CTxMemPoolEntry* getEntry(const uint256& hash) const;
+    void setEntryTime(const uint256& hash, int64_t nTime);
+
+    // In-pool transactions this one spends from, directly or not, and the
+    // ones spending from it
+    void calculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void calculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    // Count, size and fees of a transaction together with its ancestors,
+    // or with its descendants
+    void getAncestorStats(const uint256& hash, unsigned int& nCount, uint64_t& nSize, int64_t& nFees) const;
+    void getDescendantStats(const uint256& hash, unsigned int& nCount, uint64_t& nSize, int64_t& nFees) const;
+
+    // Drop transactions older than nTimeCutoff and then evict the
+    // transactions with the lowest descendant package fee rate, together
+    // with their descendants, until the pool fits into nMaxBytes. Returns
+    // the number of transactions removed.
+    unsigned int expire(int64_t nTimeCutoff);
+    unsigned int trimToSize(uint64_t nMaxBytes);
+
+    // Fee per kilobyte a new transaction needs to enter the pool. Evictions
+    // raise it above the fee rate of what was evicted, so that doesn't come
+    // straight back in, and it then halves every ROLLING_FEE_HALFLIFE.
+    double GetMinFeePerKb();
 
     size_t size()
     {
@@ -1111,6 +1111,8 @@ void ThreadDumpAddress2(void* parg)
     while (!fShutdown)
     {
         DumpAddresses();
+        if (GetBoolArg("-persistmempool", true))
+            DumpMempool();
         vnThreadsRunning[THREAD_DUMPADDRESS]--;
         Sleep(600000);
         vnThreadsRunning[THREAD_DUMPADDRESS]++;
@@ -1797,6 +1799,7 @@ bool StopNode()
     {
         LOCK(cs_main);
         ThreadScriptCheckQuit();
+        ThreadBlockCheckQuit();
     }
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -1822,7 +1825,8 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
     if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0)
+    if (vnThreadsRunning[THREAD_BLOCKCHECK] > 0) printf("ThreadBlockCheck still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0 || vnThreadsRunning[THREAD_BLOCKCHECK] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
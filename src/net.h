@@ -114,6 +114,7 @@ enum threadId
     THREAD_RPCHANDLER,
     THREAD_MINTER,
     THREAD_SCRIPTCHECK,
+    THREAD_BLOCKCHECK,
     THREAD_NTP,
     THREAD_IPCOLLECTOR,
 
@@ -215,6 +216,9 @@ public:
     uint256 hashLastGetBlocksEnd;
     int32_t nStartingHeight;
     bool fStartSync;
+    int64_t nLastGetHeaders;
+    bool fGetHeadersPending; // headers are only taken in reply to our getheaders
+    std::map<uint256, int64_t> mapBlocksInFlight; // headers-first block requests
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
@@ -264,6 +268,8 @@ public:
         nNextAddrSend = 0;
         nNextInvSend = 0;
         fStartSync = false;
+        nLastGetHeaders = 0;
+        fGetHeadersPending = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
@@ -201,19 +201,66 @@ Value settxfee(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose=true returns an object per transaction with its size, fee,\n"
+            "priority, in-pool dependencies and ancestor package totals.");
+
+    bool fVerbose = params.size() > 0 ? params[0].get_bool() : false;
+
+    if (!fVerbose)
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        Array a;
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            a.push_back(hash.ToString());
+
+        return a;
+    }
 
-    vector<uint256> vtxid;
-    mempool.queryHashes(vtxid);
+    Object result;
+    LOCK(mempool.cs);
+    for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+    {
+        const uint256& hash = (*mi).first;
+        const CTxMemPoolEntry& entry = (*mi).second;
+
+        Object info;
+        info.push_back(Pair("size", (int)entry.nTxSize));
+        info.push_back(Pair("time", entry.nTime));
+        info.push_back(Pair("scored", entry.fScored));
+        if (entry.fScored)
+        {
+            info.push_back(Pair("fee", ValueFromAmount(entry.nFee)));
+            info.push_back(Pair("feeperkb", ValueFromAmount((int64_t)entry.GetFeePerKb())));
+            info.push_back(Pair("height", entry.nHeight));
+            info.push_back(Pair("startingpriority", entry.dPriority));
+            info.push_back(Pair("currentpriority", entry.GetPriority(nBestHeight)));
+        }
 
-    Array a;
-    BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        unsigned int nCount;
+        uint64_t nSize;
+        int64_t nFees;
+        mempool.getAncestorStats(hash, nCount, nSize, nFees);
+        info.push_back(Pair("ancestorcount", (int)nCount));
+        info.push_back(Pair("ancestorsize", (int64_t)nSize));
+        info.push_back(Pair("ancestorfees", ValueFromAmount(nFees)));
+
+        Array depends;
+        set<uint256> setDepends;
+        BOOST_FOREACH(const CTxIn& txin, mempool.mapTx[hash].vin)
+            if (mempool.mapTx.count(txin.prevout.hash) && setDepends.insert(txin.prevout.hash).second)
+                depends.push_back(txin.prevout.hash.ToString());
+        info.push_back(Pair("depends", depends));
+
+        result.push_back(Pair(hash.GetHex(), info));
+    }
 
-    return a;
+    return result;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -247,6 +294,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (pblockindex->IsPruned())
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -265,11 +314,9 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    pblockindex = mapBlockIndex[*pblockindex->phashBlock];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (pblockindex->IsPruned())
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -311,6 +358,8 @@ Value dumpblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (pblockindex->IsPruned())
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -337,11 +386,9 @@ Value dumpblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    pblockindex = mapBlockIndex[*pblockindex->phashBlock];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (pblockindex->IsPruned())
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -355,6 +402,74 @@ Value dumpblockbynumber(const Array& params, bool fHelp)
     return HexStr(ssBlock.begin(), ssBlock.end());
 }
 
+// Block compression savings and the cost of reading compressed blocks
+Value getcompressioninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getcompressioninfo [blocks=100]\n"
+            "Shows how much space block compression saved since startup and what\n"
+            "compressed block reads cost. The last [blocks] blocks of the chain are\n"
+            "also read and compressed to estimate the savings on it.");
+
+    int nBlocks = params.size() > 0 ? params[0].get_int() : 100;
+    if (nBlocks < 1 || nBlocks > 10000)
+        throw runtime_error("Number of blocks out of range.");
+
+    Object result;
+    result.push_back(Pair("enabled", fCompressBlocks));
+
+    uint64_t nCompressed, nRawBytes, nStoredBytes, nReads;
+    int64_t nReadMicros;
+    GetBlockCompressionStats(nCompressed, nRawBytes, nStoredBytes, nReads, nReadMicros);
+    result.push_back(Pair("blockscompressed", (int64_t)nCompressed));
+    result.push_back(Pair("rawbytes", (int64_t)nRawBytes));
+    result.push_back(Pair("storedbytes", (int64_t)nStoredBytes));
+    result.push_back(Pair("ratio", nRawBytes ? (double)nStoredBytes / nRawBytes : 1.0));
+    result.push_back(Pair("compressedreads", (int64_t)nReads));
+    result.push_back(Pair("avgreadus", nReads ? (double)nReadMicros / nReads : 0.0));
+
+    // Sample the tip of the chain, whatever way it is stored
+    const unsigned int nHeaderSize = ::GetSerializeSize(CBlock(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+    int nSampled = 0;
+    uint64_t nSampleRaw = 0, nSampleCompressed = 0;
+    int64_t nSampleReadMicros = 0, nSampleInflateMicros = 0;
+    for (CBlockIndex* pindex = pindexBest; pindex && nSampled < nBlocks && !pindex->IsPruned(); pindex = pindex->pprev)
+    {
+        CBlock block;
+        int64_t nStart = GetTimeMicros();
+        if (!block.ReadFromDisk(pindex, true))
+            throw JSONRPCError(RPC_MISC_ERROR, "Block read failed");
+        nSampleReadMicros += GetTimeMicros() - nStart;
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block;
+        vector<unsigned char> vchCompressed;
+        if (!CompressBlockData(&ss[nHeaderSize], &ss[0] + ss.size(), vchCompressed))
+            throw JSONRPCError(RPC_MISC_ERROR, "Block compression failed");
+
+        vector<char> vchRaw(ss.size() - nHeaderSize);
+        nStart = GetTimeMicros();
+        if (!DecompressBlockData(&vchCompressed[0], &vchCompressed[0] + vchCompressed.size(), &vchRaw[0], vchRaw.size()))
+            throw JSONRPCError(RPC_MISC_ERROR, "Block decompression failed");
+        nSampleInflateMicros += GetTimeMicros() - nStart;
+
+        nSampleRaw += ss.size();
+        nSampleCompressed += nHeaderSize + sizeof(unsigned int) + vchCompressed.size();
+        nSampled++;
+    }
+
+    Object sample;
+    sample.push_back(Pair("blocks", nSampled));
+    sample.push_back(Pair("rawbytes", (int64_t)nSampleRaw));
+    sample.push_back(Pair("compressedbytes", (int64_t)nSampleCompressed));
+    sample.push_back(Pair("ratio", nSampleRaw ? (double)nSampleCompressed / nSampleRaw : 1.0));
+    sample.push_back(Pair("avgreadus", nSampled ? (double)nSampleReadMicros / nSampled : 0.0));
+    sample.push_back(Pair("avginflateus", nSampled ? (double)nSampleInflateMicros / nSampled : 0.0));
+    result.push_back(Pair("sample", sample));
+
+    return result;
+}
 
 // get information of sync-checkpoint
 Value getcheckpoint(const Array& params, bool fHelp)
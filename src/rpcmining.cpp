@@ -63,7 +63,28 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("netmhashps",    GetPoWMHashPS()));
     obj.push_back(Pair("netstakeweight",GetPoSKernelPS()));
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
-    obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    {
+        LOCK(mempool.cs);
+        obj.push_back(Pair("pooledtx",      (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("pooledtxbytes", mempool.nTotalTxSize));
+        obj.push_back(Pair("mempoolminfee", ValueFromAmount((int64_t)mempool.GetMinFeePerKb())));
+    }
+    obj.push_back(Pair("maxmempool",    nMaxMempoolBytes));
+
+    uint64_t nSigCacheHits, nSigCacheMisses, nSigCacheEntries, nSigCacheBytes;
+    GetSignatureCacheStats(nSigCacheHits, nSigCacheMisses, nSigCacheEntries, nSigCacheBytes);
+    obj.push_back(Pair("sigcachehits",    nSigCacheHits));
+    obj.push_back(Pair("sigcachemisses",  nSigCacheMisses));
+    obj.push_back(Pair("sigcacheentries", nSigCacheEntries));
+    obj.push_back(Pair("sigcachebytes",   nSigCacheBytes));
+
+    unsigned int nOrphans, nOrphansSpilled;
+    uint64_t nOrphanBytes, nOrphanSpillBytes;
+    GetOrphanBlockStats(nOrphans, nOrphansSpilled, nOrphanBytes, nOrphanSpillBytes);
+    obj.push_back(Pair("orphanblocks",  (uint64_t)nOrphans));
+    obj.push_back(Pair("orphanblocksondisk", (uint64_t)nOrphansSpilled));
+    obj.push_back(Pair("orphanblockbytes", nOrphanBytes));
+    obj.push_back(Pair("orphanblockdiskbytes", nOrphanSpillBytes));
 
     obj.push_back(Pair("stakeinputs",   (uint64_t)nStakeInputsMapSize));
     obj.push_back(Pair("stakeinterest", GetProofOfStakeReward(0, GetLastBlockIndex(pindexBest, true)->nBits, GetLastBlockIndex(pindexBest, true)->nTime, true)));
@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,25 +15,11 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* pcache=NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
 
 bool CastToBool(const valtype& vch)
 {
@@ -415,9 +400,8 @@ bool CheckSequence(const int64_t& nSequence, const CTransaction &txTo, unsigned
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
@@ -489,7 +473,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -571,7 +555,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 1)
                         return false;
 
-                    CBigNum nLockTime = CastToBigNum(stacktop(-1));
+                    CScriptNum nLockTime(stacktop(-1));
 
                     // In the rare event that the argument may be < 0 due to
                     // some arithmetic being done first, you can always use
@@ -580,7 +564,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     // Actually compare the specified lock time with the transaction.
-                    if (!CheckLockTime(nLockTime.getuint64(), txTo, nIn))
+                    if (!CheckLockTime(nLockTime.getint64(), txTo, nIn))
                         return false;
 
                     break;
@@ -599,7 +583,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // nSequence, like nLockTime, is a 32-bit unsigned integer
                     // field. See the comment in CHECKLOCKTIMEVERIFY regarding
                     // 5-byte numeric operands.
-                    CBigNum nSequence = CastToBigNum(stacktop(-1));
+                    CScriptNum nSequence(stacktop(-1));
 
                     // In the rare event that the argument may be < 0 due to
                     // some arithmetic being done first, you can always use
@@ -614,7 +598,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         break;
 
                     // Compare the specified sequence number with the input.
-                    if (!CheckSequence(nSequence.getuint64(), txTo, nIn))
+                    if (!CheckSequence(nSequence.getint64(), txTo, nIn))
                         return false;
 
                     break;
@@ -726,7 +710,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn((uint16_t) stack.size());
+                    CScriptNum bn((int64_t) stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -776,7 +760,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint32();
+                    int n = CScriptNum(stacktop(-1)).getint32();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -824,7 +808,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn((uint16_t) stacktop(-1).size());
+                    CScriptNum bn((int64_t) stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -875,15 +859,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_1ADD:       bn += 1; break;
+                    case OP_1SUB:       bn -= 1; break;
                     case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_ABS:        if (bn < 0) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == 0); break;
+                    case OP_0NOTEQUAL:  bn = (bn != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
@@ -908,9 +892,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -921,8 +905,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_BOOLAND:             bn = (bn1 != 0 && bn2 != 0); break;
+                    case OP_BOOLOR:              bn = (bn1 != 0 || bn2 != 0); break;
                     case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
                     case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
                     case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
@@ -953,9 +937,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -1028,7 +1012,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1052,7 +1036,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint32();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint32();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -1063,7 +1047,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint32();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint32();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1089,7 +1073,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                         if (fOk) {
                             isig++;
@@ -1160,19 +1144,77 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
+{
+    CDataStream ssHeader(SER_GETHASH, 0);
+    ssHeader << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ssHeader, txTo.vin.size());
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &ssHeader[0], ssHeader.size());
+
+    // Every input serialized with an empty scriptSig
+    CDataStream ssTail(SER_GETHASH, 0);
+    ssTail.reserve(txTo.vin.size() * 41 + 10000);
+    vMidstate.reserve(txTo.vin.size());
+    vTailPos.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate.push_back(ctx);
+        unsigned int nPos = ssTail.size();
+        ssTail << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        SHA256_Update(&ctx, &ssTail[nPos], ssTail.size() - nPos);
+        vTailPos.push_back(ssTail.size());
+    }
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+}
+
+bool CSignatureHashCache::Get(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY))
+        return false;
+    if (nIn >= vMidstate.size())
+        return false;
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(scriptCode.size() + 64);
+    ss << txTo.vin[nIn].prevout << scriptCode << txTo.vin[nIn].nSequence;
+
+    CDataStream ssHashType(SER_GETHASH, 0);
+    ssHashType << nHashType;
+
+    SHA256_CTX ctx = vMidstate[nIn];
+    SHA256_Update(&ctx, &ss[0], ss.size());
+    if (vTailPos[nIn] < vchTail.size())
+        SHA256_Update(&ctx, &vchTail[vTailPos[nIn]], vchTail.size() - vTailPos[nIn]);
+    SHA256_Update(&ctx, &ssHashType[0], ssHashType.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hashRet);
+    return true;
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache = NULL)
 {
     if (nIn >= txTo.vin.size())
     {
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
+    uint256 hash;
+    if (pcache && pcache->Get(scriptCode, txTo, nIn, nHashType, hash))
+        return hash;
+
+    CTransaction txTmp(txTo);
+
     // Blank out other inputs' signatures
     for (unsigned int i = 0; i < txTmp.vin.size(); i++)
         txTmp.vin[i].scriptSig = CScript();
@@ -1227,62 +1269,152 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+//
+// Entries are salted SHA256 digests of (signature hash, public key,
+// signature), kept in fixed size cuckoo tables. Every digest has two slots;
+// inserting into a full pair moves the occupant to its other slot, and after
+// a few moves the last one displaced is dropped. That drops an effectively
+// random entry, which helps foil would-be DoS attackers who might try to
+// pre-generate and re-use a set of valid signatures just-slightly-greater
+// than our cache size. The table is split in shards with a lock each so the
+// script check threads rarely wait on each other.
+//
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey > sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int NUM_SHARDS = 16;
+    static const unsigned int MAX_KICKS = 8;
+
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<uint256> vSlots;
+        uint64_t nEntries;
+        uint64_t nHits;
+        uint64_t nMisses;
+    };
+
+    uint256 nonce;
+    unsigned int nSlotsPerShard;
+    CShard shards[NUM_SHARDS];
+
+    uint256 GetDigest(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        SHA256_CTX ctx;
+        uint256 digest;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, (const unsigned char*)&nonce, sizeof(nonce));
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        SHA256_Final((unsigned char*)&digest, &ctx);
+        return digest;
+    }
+
+    // Independent 32 bit words of the digest pick the shard and both slots
+    unsigned int GetShard(const uint256& digest) const
+    {
+        return digest.Get32(0) % NUM_SHARDS;
+    }
+
+    unsigned int GetSlot(const uint256& digest, int n) const
+    {
+        return digest.Get32(1 + n) % nSlotsPerShard;
+    }
 
 public:
+    CSignatureCache()
+    {
+        nonce = GetRandHash();
+
+        // -maxsigcachesize is a budget in megabytes for all shards together
+        int64_t nMaxCacheMB = std::min(GetArg("-maxsigcachesize", DEFAULT_SIGCACHE_SIZE_MB), (int64_t)MAX_SIGCACHE_SIZE_MB);
+        nSlotsPerShard = nMaxCacheMB > 0 ? (unsigned int)((nMaxCacheMB << 20) / sizeof(uint256) / NUM_SHARDS) : 0;
+        for (unsigned int i = 0; i < NUM_SHARDS; i++)
+        {
+            shards[i].vSlots.assign(nSlotsPerShard, 0);
+            shards[i].nEntries = shards[i].nHits = shards[i].nMisses = 0;
+        }
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nSlotsPerShard == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
+        uint256 digest = GetDigest(hash, vchSig, pubKey);
+        CShard& shard = shards[GetShard(digest)];
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.vSlots[GetSlot(digest, 0)] == digest || shard.vSlots[GetSlot(digest, 1)] == digest)
+        {
+            shard.nHits++;
             return true;
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nSlotsPerShard == 0)
+            return;
+
+        uint256 digest = GetDigest(hash, vchSig, pubKey);
+        CShard& shard = shards[GetShard(digest)];
+        boost::unique_lock<boost::mutex> lock(shard.cs);
 
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        unsigned int nSlot = GetSlot(digest, 0);
+        unsigned int nSlotAlt = GetSlot(digest, 1);
+        if (shard.vSlots[nSlot] == digest || shard.vSlots[nSlotAlt] == digest)
+            return;
+        if (shard.vSlots[nSlot] != 0 && shard.vSlots[nSlotAlt] == 0)
+            nSlot = nSlotAlt;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        for (unsigned int nKicks = 0; nKicks <= MAX_KICKS; nKicks++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            std::swap(digest, shard.vSlots[nSlot]);
+            if (digest == 0)
+            {
+                shard.nEntries++;
+                return;
+            }
+            // the displaced entry moves to its other slot
+            nSlot = (GetSlot(digest, 0) == nSlot) ? GetSlot(digest, 1) : GetSlot(digest, 0);
         }
+        // the last displaced entry is dropped
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nBytes)
+    {
+        nHits = nMisses = nEntries = nBytes = 0;
+        for (unsigned int i = 0; i < NUM_SHARDS; i++)
+        {
+            boost::unique_lock<boost::mutex> lock(shards[i].cs);
+            nHits += shards[i].nHits;
+            nMisses += shards[i].nMisses;
+            nEntries += shards[i].nEntries;
+            nBytes += shards[i].vSlots.size() * sizeof(uint256);
+        }
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nBytes)
+{
+    GetSignatureCache().GetStats(nHits, nMisses, nEntries, nBytes);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* pcache)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1297,7 +1429,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pcache);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1435,7 +1567,7 @@ bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsi
             {   // Up to four-byte integer pushed onto vSolutions
                 try
                 {
-                    CBigNum bnVal = CastToBigNum(vch1);
+                    CScriptNum bnVal(vch1);
                     if (bnVal <= 16)
                         break; // It's better to use OP_0 ... OP_16 for small integers.
                     vSolutionsRet.push_back(vch1);
@@ -1843,15 +1975,180 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
+//
+// Fast paths for the standard templates. Each one is taken only when the
+// scripts have exactly the expected shape, and then repeats the steps
+// EvalScript would perform (including the FindAndDelete on the script code
+// and the order in which CHECKMULTISIG pairs keys and signatures) without
+// running the interpreter. Anything else returns false and is left to the
+// generic path.
+//
+
+// Split a script made of data pushes only into the pushed values
+static bool GetDataPushes(const CScript& script, vector<valtype>& vPushes)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vch;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vch))
+            return false;
+        if (opcode > OP_PUSHDATA4 || vch.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        vPushes.push_back(vch);
+    }
+    return true;
+}
+
+static bool VerifyStandardCheckSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptPubKey,
+                                   const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
+{
+    CScript scriptCode(scriptPubKey);
+    scriptCode.FindAndDelete(CScript(vchSig));
+
+    return IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
+        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
+}
+
+static bool VerifyStandardMultisig(const vector<valtype>& vPushes, const CScript& redeemScript, const CTransaction& txTo,
+                                   unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache, bool& fResult)
+{
+    // OP_m <pubkey> ... <pubkey> OP_n OP_CHECKMULTISIG
+    CScript::const_iterator pc = redeemScript.begin();
+    opcodetype opcode;
+    valtype vch;
+    if (!redeemScript.GetOp(pc, opcode) || opcode < OP_1 || opcode > OP_16)
+        return false;
+    int nSigsRequired = CScript::DecodeOP_N(opcode);
+
+    vector<valtype> vPubKeys;
+    while (true)
+    {
+        if (!redeemScript.GetOp(pc, opcode, vch))
+            return false;
+        if (opcode > OP_PUSHDATA4)
+            break;
+        if (vch.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        vPubKeys.push_back(vch);
+    }
+    if (opcode < OP_1 || opcode > OP_16 || CScript::DecodeOP_N(opcode) != (int)vPubKeys.size())
+        return false;
+    if (!redeemScript.GetOp(pc, opcode) || opcode != OP_CHECKMULTISIG || pc != redeemScript.end())
+        return false;
+
+    // Dummy element, exactly nSigsRequired signatures and the redeem script
+    if (nSigsRequired > (int)vPubKeys.size() || (int)vPushes.size() != nSigsRequired + 2)
+        return false;
+
+    if ((flags & SCRIPT_VERIFY_NULLDUMMY) && vPushes[0].size())
+    {
+        fResult = error("CHECKMULTISIG dummy argument not null");
+        return true;
+    }
+
+    // Signatures are dropped from the script code and matched against the
+    // keys starting from the top of the stack, as in EvalScript
+    CScript scriptCode(redeemScript);
+    for (int k = nSigsRequired; k > 0; k--)
+        scriptCode.FindAndDelete(CScript(vPushes[k]));
+
+    int nSigsCount = nSigsRequired;
+    int nKeysCount = vPubKeys.size();
+    int isig = nSigsRequired, ikey = nKeysCount - 1;
+    bool fSuccess = true;
+    while (fSuccess && nSigsCount > 0)
+    {
+        const valtype& vchSig = vPushes[isig];
+        const valtype& vchPubKey = vPubKeys[ikey];
+
+        bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
+            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
+
+        if (fOk) {
+            isig--;
+            nSigsCount--;
+        }
+        ikey--;
+        nKeysCount--;
+
+        if (nSigsCount > nKeysCount)
+            fSuccess = false;
+    }
+
+    fResult = fSuccess;
+    return true;
+}
+
+// Returns true and sets fResult if the scripts matched a standard template
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                                 unsigned int flags, int nHashType, const CSignatureHashCache* pcache, bool& fResult)
+{
+    vector<valtype> vPushes;
+    if (!GetDataPushes(scriptSig, vPushes))
+        return false;
+
+    // OP_DUP OP_HASH160 <20 byte hash> OP_EQUALVERIFY OP_CHECKSIG
+    if (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 &&
+        scriptPubKey[2] == 20 && scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        if (vPushes.size() != 2)
+            return false;
+        uint160 hash = Hash160(vPushes[1]);
+        if (memcmp(&hash, &scriptPubKey[3], 20) != 0)
+            fResult = false;
+        else
+            fResult = VerifyStandardCheckSig(vPushes[0], vPushes[1], scriptPubKey, txTo, nIn, flags, nHashType, pcache);
+        return true;
+    }
+
+    // <pubkey> OP_CHECKSIG
+    if (scriptPubKey.size() > 1 && scriptPubKey.back() == OP_CHECKSIG)
+    {
+        CScript::const_iterator pc = scriptPubKey.begin();
+        opcodetype opcode;
+        valtype vchPubKey;
+        if (!scriptPubKey.GetOp(pc, opcode, vchPubKey) || opcode > OP_PUSHDATA4 || vchPubKey.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        if (pc + 1 != scriptPubKey.end() || vPushes.size() != 1)
+            return false;
+        fResult = VerifyStandardCheckSig(vPushes[0], vchPubKey, scriptPubKey, txTo, nIn, flags, nHashType, pcache);
+        return true;
+    }
+
+    // Multisig wrapped in OP_HASH160 <20 byte hash> OP_EQUAL
+    if ((flags & SCRIPT_VERIFY_P2SH) && scriptPubKey.IsPayToScriptHash())
+    {
+        if (vPushes.size() < 2)
+            return false;
+        const valtype& vchRedeemScript = vPushes.back();
+        uint160 hash = Hash160(vchRedeemScript);
+        if (memcmp(&hash, &scriptPubKey[2], 20) != 0)
+        {
+            fResult = false;
+            return true;
+        }
+        CScript redeemScript(vchRedeemScript.begin(), vchRedeemScript.end());
+        return VerifyStandardMultisig(vPushes, redeemScript, txTo, nIn, flags, nHashType, pcache, fResult);
+    }
+
+    return false;
+}
+
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache* pcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    bool fResult;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, flags, nHashType, pcache, fResult))
+        return fResult;
+
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (stack.empty())
         return false;
@@ -1874,7 +2171,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1884,14 +2181,14 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, pcache);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1905,7 +2202,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, pcache);
 
         txnouttype subType;
         bool fSolved =
@@ -1916,10 +2213,10 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0, pcache);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1927,7 +2224,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pcache);
 }
 
 static CScript PushAll(const vector<valtype>& values)
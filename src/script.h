@@ -5,10 +5,13 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <openssl/sha.h>
 
 #include "keystore.h"
 #include "bignum.h"
@@ -21,6 +24,10 @@ class CBitcoinAddress;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 
+// Signature cache memory budget in megabytes, default and upper limit
+static const int64_t DEFAULT_SIGCACHE_SIZE_MB = 32;
+static const int64_t MAX_SIGCACHE_SIZE_MB = 256;
+
 // Setting nSequence to this value for every input in a transaction
 // disables nLockTime.
 static const uint32_t SEQUENCE_FINAL = 0xffffffff;
@@ -258,10 +265,127 @@ enum opcodetype
 
 const char* GetOpName(opcodetype opcode);
 
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+// Numeric operand of the script interpreter.
+//
+// Operands are at most 4 bytes wide, little endian sign-magnitude with the
+// sign in the high bit of the last byte, so any result of the arithmetic
+// opcodes fits in an int64_t. This gives the same results as the CBigNum
+// arithmetic it replaces without touching the heap: non-minimal encodings
+// (including negative zero) are accepted on input, and results are always
+// serialized minimally, with zero as the empty vector.
+class CScriptNum
+{
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(const int64_t& n) : m_value(n) {}
+
+    explicit CScriptNum(const std::vector<uint8_t>& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        m_value = set_vch(vch);
+    }
+
+    bool operator==(const int64_t& rhs) const { return m_value == rhs; }
+    bool operator!=(const int64_t& rhs) const { return m_value != rhs; }
+    bool operator<=(const int64_t& rhs) const { return m_value <= rhs; }
+    bool operator< (const int64_t& rhs) const { return m_value <  rhs; }
+    bool operator>=(const int64_t& rhs) const { return m_value >= rhs; }
+    bool operator> (const int64_t& rhs) const { return m_value >  rhs; }
+
+    bool operator==(const CScriptNum& rhs) const { return operator==(rhs.m_value); }
+    bool operator!=(const CScriptNum& rhs) const { return operator!=(rhs.m_value); }
+    bool operator<=(const CScriptNum& rhs) const { return operator<=(rhs.m_value); }
+    bool operator< (const CScriptNum& rhs) const { return operator< (rhs.m_value); }
+    bool operator>=(const CScriptNum& rhs) const { return operator>=(rhs.m_value); }
+    bool operator> (const CScriptNum& rhs) const { return operator> (rhs.m_value); }
+
+    CScriptNum operator+(const int64_t& rhs) const { return CScriptNum(m_value + rhs); }
+    CScriptNum operator-(const int64_t& rhs) const { return CScriptNum(m_value - rhs); }
+    CScriptNum operator+(const CScriptNum& rhs) const { return operator+(rhs.m_value); }
+    CScriptNum operator-(const CScriptNum& rhs) const { return operator-(rhs.m_value); }
+
+    CScriptNum& operator+=(const int64_t& rhs) { m_value += rhs; return *this; }
+    CScriptNum& operator-=(const int64_t& rhs) { m_value -= rhs; return *this; }
+    CScriptNum& operator+=(const CScriptNum& rhs) { return operator+=(rhs.m_value); }
+    CScriptNum& operator-=(const CScriptNum& rhs) { return operator-=(rhs.m_value); }
+
+    CScriptNum operator-() const { return CScriptNum(-m_value); }
+
+    CScriptNum& operator=(const int64_t& rhs) { m_value = rhs; return *this; }
+
+    // Saturates like CBigNum::getint32()
+    int32_t getint32() const
+    {
+        if (m_value > std::numeric_limits<int32_t>::max())
+            return std::numeric_limits<int32_t>::max();
+        else if (m_value < std::numeric_limits<int32_t>::min())
+            return std::numeric_limits<int32_t>::min();
+        return (int32_t)m_value;
+    }
+
+    int64_t getint64() const { return m_value; }
+
+    std::vector<uint8_t> getvch() const
+    {
+        return serialize(m_value);
+    }
+
+    static std::vector<uint8_t> serialize(const int64_t& value)
+    {
+        std::vector<uint8_t> result;
+        if (value == 0)
+            return result;
+
+        const bool fNegative = value < 0;
+        uint64_t nAbs = fNegative ? ~(uint64_t)value + 1 : (uint64_t)value;
+        while (nAbs)
+        {
+            result.push_back(nAbs & 0xff);
+            nAbs >>= 8;
+        }
+
+        // The sign lives in the high bit of the last byte; if the magnitude
+        // already uses that bit, append a byte to hold it.
+        if (result.back() & 0x80)
+            result.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            result.back() |= 0x80;
+
+        return result;
+    }
+
+private:
+    static int64_t set_vch(const std::vector<uint8_t>& vch)
+    {
+        if (vch.empty())
+            return 0;
+
+        int64_t result = 0;
+        for (size_t i = 0; i != vch.size(); ++i)
+            result |= (int64_t)vch[i] << (8 * i);
+
+        // Clear the sign bit and negate if it was set
+        if (vch.back() & 0x80)
+            return -(int64_t)(result & ~((int64_t)0x80 << (8 * (vch.size() - 1))));
+
+        return result;
+    }
+
+    int64_t m_value;
+};
+
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
-        return strprintf("%d", CBigNum(vch).getint32());
+        return strprintf("%d", CScriptNum(vch).getint32());
     else
         return HexStr(vch);
 }
@@ -632,7 +756,30 @@ bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int
 bool IsDERSignature(const valtype &vchSig, bool fWithHashType=false, bool fCheckLow=false);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+// Precomputed SIGHASH_ALL serialization of a transaction.
+//
+// Signature hashes cover the whole transaction with the other inputs'
+// scripts blanked, so without this every input checked or signed copies and
+// reserializes the transaction. The cache keeps the blanked serialization
+// after each input and the SHA256 state before each input, so the hash for
+// one input only feeds its own prevout, script code and sequence followed
+// by the stored tail. Other hash types are computed the usual way.
+// It only depends on prevouts, sequences and outputs, so it stays valid
+// while scriptSigs are being filled in.
+class CSignatureHashCache
+{
+private:
+    std::vector<SHA256_CTX> vMidstate;    // state after the header and inputs before nIn
+    std::vector<unsigned int> vTailPos;   // offset in vchTail of the input after nIn
+    std::vector<uint8_t> vchTail;         // blanked inputs, outputs and nLockTime
+
+public:
+    explicit CSignatureHashCache(const CTransaction& txTo);
+
+    bool Get(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
+
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -643,9 +790,14 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractAddress(const CKeyStore &keystore, const CScript& scriptPubKey, CBitcoinAddress& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashCache* pcache=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashCache* pcache=NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* pcache=NULL);
+// Fast path of VerifyScript for P2PKH, P2PK and P2SH multisig spends. Returns
+// false if the scripts are not one of these, otherwise the result is in fResult.
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                          unsigned int flags, int nHashType, const CSignatureHashCache* pcache, bool& fResult);
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nBytes);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -17,6 +17,7 @@ private:
     void operator=(const CTxDB&);
 public:
 
+    bool TxnCommit();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -37,6 +38,8 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool ReadModifierUpgradeTime(unsigned int& nUpgradeTime);
     bool WriteModifierUpgradeTime(const unsigned int& nUpgradeTime);
+    bool ReadPrunedFile(unsigned int nFile, std::vector<CPrunedRange>& vRanges);
+    bool WritePrunedFile(unsigned int nFile, const std::vector<CPrunedRange>& vRanges);
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
@@ -8,6 +8,8 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -25,6 +27,179 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache in front of the LevelDB instance. Committed transactions
+// are not written to the database one by one, but collected here and written
+// out as a single batch once the cache is full or the initial block download
+// is over. Records read from the database are kept as well, so connecting a
+// block mostly doesn't need a database lookup for the inputs it spends.
+//
+// Since whole transactions are written at once, the database on disk always
+// reflects a consistent best chain, possibly a few blocks behind the one in
+// memory. Such blocks are connected again after an unclean shutdown.
+class CTxDBCache
+{
+private:
+    // Approximate per-record overhead of the maps, added to key and value sizes
+    static const size_t nEntryOverhead = 96;
+
+    mutable CCriticalSection cs;
+    std::map<std::string, std::pair<bool, std::string> > mapPending; // key -> (erased, value)
+    std::map<std::string, std::string> mapClean;
+    size_t nPendingBytes;
+    size_t nCleanBytes;
+    size_t nMaxBytes;
+
+    void EraseClean(const std::string& strKey)
+    {
+        std::map<std::string, std::string>::iterator mi = mapClean.find(strKey);
+        if (mi == mapClean.end())
+            return;
+        nCleanBytes -= mi->first.size() + mi->second.size() + nEntryOverhead;
+        mapClean.erase(mi);
+    }
+
+    void ErasePending(const std::string& strKey)
+    {
+        std::map<std::string, std::pair<bool, std::string> >::iterator mi = mapPending.find(strKey);
+        if (mi == mapPending.end())
+            return;
+        nPendingBytes -= mi->first.size() + mi->second.second.size() + nEntryOverhead;
+        mapPending.erase(mi);
+    }
+
+    void LimitClean()
+    {
+        // Read records are cheap to fetch again, so simply start over
+        if (nPendingBytes + nCleanBytes > nMaxBytes)
+        {
+            mapClean.clear();
+            nCleanBytes = 0;
+        }
+    }
+
+public:
+    CTxDBCache() : nPendingBytes(0), nCleanBytes(0), nMaxBytes(64 * 1048576) { }
+
+    void SetMaxSize(size_t nMaxBytesIn)
+    {
+        LOCK(cs);
+        nMaxBytes = nMaxBytesIn;
+    }
+
+    bool Scan(const std::string& strKey, std::string *value, bool *deleted) const
+    {
+        LOCK(cs);
+        std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapPending.find(strKey);
+        if (mi != mapPending.end())
+        {
+            *deleted = mi->second.first;
+            if (!*deleted)
+                *value = mi->second.second;
+            return true;
+        }
+        std::map<std::string, std::string>::const_iterator mc = mapClean.find(strKey);
+        if (mc != mapClean.end())
+        {
+            *deleted = false;
+            *value = mc->second;
+            return true;
+        }
+        return false;
+    }
+
+    void AddClean(const std::string& strKey, const std::string& strValue)
+    {
+        LOCK(cs);
+        if (mapPending.count(strKey) || mapClean.count(strKey))
+            return;
+        mapClean.insert(make_pair(strKey, strValue));
+        nCleanBytes += strKey.size() + strValue.size() + nEntryOverhead;
+        LimitClean();
+    }
+
+    void Erase(const std::string& strKey)
+    {
+        LOCK(cs);
+        ErasePending(strKey);
+        EraseClean(strKey);
+    }
+
+    void Put(const std::string& strKey, const std::string& strValue, bool fErased)
+    {
+        LOCK(cs);
+        ErasePending(strKey);
+        EraseClean(strKey);
+        mapPending.insert(make_pair(strKey, make_pair(fErased, strValue)));
+        nPendingBytes += strKey.size() + strValue.size() + nEntryOverhead;
+        LimitClean();
+    }
+
+    bool IsFull() const
+    {
+        LOCK(cs);
+        return nPendingBytes > nMaxBytes / 2;
+    }
+
+    bool Flush(leveldb::DB *pdb)
+    {
+        LOCK(cs);
+        if (mapPending.empty())
+            return true;
+
+        int64_t nStart = GetTimeMillis();
+        leveldb::WriteBatch batch;
+        for (std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi)
+        {
+            if (mi->second.first)
+                batch.Delete(mi->first);
+            else
+                batch.Put(mi->first, mi->second.second);
+        }
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            return error("CTxDB::Flush() : LevelDB batch write failure: %s", status.ToString().c_str());
+
+        if (fDebug)
+            printf("CTxDB::Flush() : wrote %" PRIszu " records (%" PRIszu " bytes) in %" PRId64 "ms\n",
+                mapPending.size(), nPendingBytes, GetTimeMillis() - nStart);
+
+        // Written records stay cached as clean ones
+        for (std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi)
+        {
+            if (mi->second.first)
+                continue;
+            mapClean.insert(make_pair(mi->first, mi->second.second));
+            nCleanBytes += mi->first.size() + mi->second.second.size() + nEntryOverhead;
+        }
+        mapPending.clear();
+        nPendingBytes = 0;
+        LimitClean();
+        return true;
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        mapPending.clear();
+        mapClean.clear();
+        nPendingBytes = nCleanBytes = 0;
+    }
+};
+
+static CTxDBCache txdbcache;
+
+// Moves the contents of a committed batch into the write-back cache
+class CBatchCacheWriter : public leveldb::WriteBatch::Handler {
+public:
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        txdbcache.Put(key.ToString(), value.ToString(), false);
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        txdbcache.Put(key.ToString(), string(), true);
+    }
+};
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArgInt("-dbcache", 25);
@@ -81,6 +256,7 @@ CTxDB::CTxDB(const char* pszMode)
     options = GetOptions();
     options.create_if_missing = fCreate;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    txdbcache.SetMaxSize((size_t)GetArgInt("-txcache", 64) * 1048576);
 
     init_blockindex(options); // Init directory
     pdb = txdb;
@@ -95,6 +271,7 @@ CTxDB::CTxDB(const char* pszMode)
             printf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
             // Leveldb instance destruction
+            txdbcache.Clear();
             delete txdb;
             txdb = pdb = NULL;
             delete activeBatch;
@@ -122,6 +299,8 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    Flush();
+    txdbcache.Clear();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -142,16 +321,32 @@ bool CTxDB::TxnBegin()
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    CBatchCacheWriter writer;
+    leveldb::Status status = activeBatch->Iterate(&writer);
     delete activeBatch;
     activeBatch = NULL;
     if (!status.ok()) {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
     }
+
+    // Keep collecting changes while catching up with the network, write them
+    // out right away afterwards.
+    if (txdbcache.IsFull() || !IsInitialBlockDownload())
+        return Flush();
     return true;
 }
 
+bool CTxDB::Flush()
+{
+    if (!pdb)
+        return false;
+    // Block data the index refers to must be on disk first
+    if (!FlushBlockFiles())
+        return false;
+    return txdbcache.Flush(pdb);
+}
+
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
     std::string needle;
@@ -196,6 +391,19 @@ bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) cons
     return scanner.foundEntry;
 }
 
+bool CTxDB::ScanCache(const CDataStream &key, string *value, bool *deleted) const {
+    *deleted = false;
+    return txdbcache.Scan(key.str(), value, deleted);
+}
+
+void CTxDB::AddToCache(const CDataStream &key, const string &value) const {
+    txdbcache.AddClean(key.str(), value);
+}
+
+void CTxDB::EraseFromCache(const CDataStream &key) const {
+    txdbcache.Erase(key.str());
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -314,26 +522,70 @@ bool CTxDB::WriteModifierUpgradeTime(const unsigned int& nUpgradeTime)
     return Write(string("nUpgradeTime"), nUpgradeTime);
 }
 
+bool CTxDB::ReadPrunedFile(unsigned int nFile, vector<CPrunedRange>& vRanges)
+{
+    return Read(make_pair(string("prunedfile"), nFile), vRanges);
+}
+
+bool CTxDB::WritePrunedFile(unsigned int nFile, const vector<CPrunedRange>& vRanges)
+{
+    return Write(make_pair(string("prunedfile"), nFile), vRanges);
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = mapBlockIndex.NewIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Run fn(nBegin, nEnd) on parts of [0, nSize) in parallel threads
+static void ParallelFor(size_t nSize, const boost::function<void(size_t, size_t)>& fn)
+{
+    size_t nThreads = boost::thread::hardware_concurrency();
+    if (nThreads == 0)
+        nThreads = 1;
+    // Not worth a thread below a few thousand entries
+    nThreads = min(nThreads, nSize / 4096 + 1);
+    size_t nPart = (nSize + nThreads - 1) / nThreads;
+
+    boost::thread_group group;
+    for (size_t i = 1; i < nThreads; i++)
+        group.create_thread(boost::bind(fn, min(nSize, nPart * i), min(nSize, nPart * (i + 1))));
+    fn(0, min(nSize, nPart));
+    group.join_all();
+}
+
+static void DecodeBlockIndexRange(const vector<string>* pvRecords, vector<CDiskBlockIndex>* pvDiskIndex, vector<uint256>* pvHash, vector<char>* pvFailed, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        const string& strValue = (*pvRecords)[i];
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> (*pvDiskIndex)[i];
+        }
+        catch (const std::exception&) {
+            (*pvFailed)[i] = 1;
+            continue;
+        }
+        // Hashing the header is the expensive part, unless -fastindex has it
+        // stored. Keep the result, GetBlockHash() would hash again.
+        (*pvHash)[i] = (*pvDiskIndex)[i].GetBlockHash();
+    }
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -341,89 +593,17 @@ bool CTxDB::LoadBlockIndex()
         // from BDB.
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
 
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
-
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
-    }
-    delete iterator;
-
-    if (fRequestShutdown)
-        return true;
-
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    // Use the snapshot left by a clean shutdown if it matches the database,
+    // scan the database otherwise
+    uint256 hashBestChainDB = 0;
+    ReadHashBestChain(hashBestChainDB);
+    if (!ReadBlockIndexSnapshot(hashBestChainDB))
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-        // NovaCoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
-        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
-            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
+        if (!LoadBlockIndexGuts())
+            return false;
+        if (fRequestShutdown)
+            return true;
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -436,6 +616,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetMainChainTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -467,6 +648,9 @@ bool CTxDB::LoadBlockIndex()
     {
         if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        // Nothing to verify in pruned blocks, which are all older
+        if (pindex->IsPruned())
+            break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
@@ -581,3 +765,132 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    int64_t nStart = GetTimeMillis();
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    // Seek to start key.
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    // Now read each entry. Only the raw values are collected here, decoding
+    // them is left to the worker threads.
+    vector<string> vRecords;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    while (iterator->Valid())
+    {
+        ssKey.clear();
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        // Did we reach the end of the data to read?
+        if (fRequestShutdown || strType != "blockindex")
+            break;
+        vRecords.push_back(iterator->value().ToString());
+        iterator->Next();
+    }
+    delete iterator;
+
+    if (fRequestShutdown)
+        return true;
+
+    printf("LoadBlockIndex(): read %" PRIszu " records in %" PRId64 "ms\n", vRecords.size(), GetTimeMillis() - nStart);
+    nStart = GetTimeMillis();
+
+    // Decode records and compute block hashes in parallel
+    vector<CDiskBlockIndex> vDiskIndex(vRecords.size());
+    vector<uint256> vHash(vRecords.size());
+    vector<char> vFailed(vRecords.size(), 0);
+    ParallelFor(vRecords.size(), boost::bind(&DecodeBlockIndexRange, &vRecords, &vDiskIndex, &vHash, &vFailed, _1, _2));
+    vector<string>().swap(vRecords);
+
+    printf("LoadBlockIndex(): decoded in %" PRId64 "ms\n", GetTimeMillis() - nStart);
+    nStart = GetTimeMillis();
+
+    // Construct block index objects
+    mapBlockIndex.reserve(vDiskIndex.size());
+    for (unsigned int i = 0; i < vDiskIndex.size(); i++)
+    {
+        if (vFailed[i])
+            return error("LoadBlockIndex() : deserialize error");
+        const CDiskBlockIndex& diskindex = vDiskIndex[i];
+
+        const uint256& blockHash = vHash[i];
+
+        // Construct block index object
+        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nMint          = diskindex.nMint;
+        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+        pindexNew->nFlags         = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake   = diskindex.prevoutStake;
+        pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex())
+            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+        // NovaCoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+    vector<CDiskBlockIndex>().swap(vDiskIndex);
+    vector<uint256>().swap(vHash);
+
+    printf("LoadBlockIndex(): linked %" PRIszu " entries in %" PRId64 "ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    nStart = GetTimeMillis();
+
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        vIndex.push_back(item.second);
+        nMaxHeight = max(nMaxHeight, item.second->nHeight);
+    }
+
+    // Order by height with a counting sort
+    vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        vHeightStart[pindex->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vector<CBlockIndex*> vSortedByHeight(vIndex.size());
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        vSortedByHeight[vHeightStart[pindex->nHeight]++] = pindex;
+
+    // Calculate nChainTrust, build skip pointers and calculate stake modifier
+    // checksums in one pass. Trust of a PoW block depends on the chain trust
+    // of its parents, so this has to run serially in height order.
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+    {
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->BuildSkip();
+        // NovaCoin: calculate stake modifier checksum
+        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
+    }
+
+    printf("LoadBlockIndex(): computed chain trust in %" PRId64 "ms\n", GetTimeMillis() - nStart);
+
+    return true;
+}
@@ -56,6 +56,13 @@ protected:
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Same as ScanBatch, but for the write-back cache shared by all CTxDB
+    // instances. It holds committed changes which are not yet written to
+    // LevelDB and records recently read from it.
+    bool ScanCache(const CDataStream &key, std::string *value, bool *deleted) const;
+    void AddToCache(const CDataStream &key, const std::string &value) const;
+    void EraseFromCache(const CDataStream &key) const;
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -74,6 +81,14 @@ protected:
                 return false;
             }
         }
+        if (readFromDb) {
+            // Then look into the write-back cache.
+            bool deleted = false;
+            readFromDb = ScanCache(ssKey, &strValue, &deleted) == false;
+            if (deleted) {
+                return false;
+            }
+        }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
                                               ssKey.str(), &strValue);
@@ -84,6 +99,7 @@ protected:
                 printf("LevelDB read failure: %s\n", status.ToString().c_str());
                 return false;
             }
+            AddToCache(ssKey, strValue);
         }
         // Unserialize value
         try {
@@ -114,6 +130,8 @@ protected:
             activeBatch->Put(ssKey.str(), ssValue.str());
             return true;
         }
+        // Written directly, so a pending cached value must not overwrite it later.
+        EraseFromCache(ssKey);
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
         if (!status.ok()) {
             printf("LevelDB write failure: %s\n", status.ToString().c_str());
@@ -137,6 +155,7 @@ protected:
             activeBatch->Delete(ssKey.str());
             return true;
         }
+        EraseFromCache(ssKey);
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
         return (status.ok() || status.IsNotFound());
     }
@@ -156,6 +175,9 @@ protected:
             }
         }
 
+        bool deleted;
+        if (ScanCache(ssKey, &unused, &deleted))
+            return !deleted;
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -165,6 +187,8 @@ protected:
 public:
     bool TxnBegin();
     bool TxnCommit();
+    // Writes all changes held in the write-back cache to LevelDB.
+    bool Flush();
     bool TxnAbort()
     {
         delete activeBatch;
@@ -203,7 +227,11 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool ReadModifierUpgradeTime(unsigned int& nUpgradeTime);
     bool WriteModifierUpgradeTime(const unsigned int& nUpgradeTime);
+    bool ReadPrunedFile(unsigned int nFile, std::vector<CPrunedRange>& vRanges);
+    bool WritePrunedFile(unsigned int nFile, const std::vector<CPrunedRange>& vRanges);
     bool LoadBlockIndex();
+private:
+    bool LoadBlockIndexGuts();
 };
 
 
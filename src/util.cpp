@@ -49,6 +49,7 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <fcntl.h> /* for fallocate */
 #endif
 
 #if !defined(WIN32) && !defined(ANDROID)
@@ -1253,11 +1254,23 @@ void FileCommit(FILE *fileout)
     fflush(fileout);                // harmless if redundantly called
 #ifdef WIN32
     _commit(_fileno(fileout));
+#elif defined(__linux__)
+    fdatasync(fileno(fileout));     // the data and file size, not timestamps
 #else
     fsync(fileno(fileout));
 #endif
 }
 
+// Reserve disk space for the given range without changing the file size,
+// so appends still go to the real end of the file. Only a hint; a no-op
+// where it is not supported.
+void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+}
+
 int GetFilesize(FILE* file)
 {
     int nSavePos = ftell(file);